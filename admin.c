@@ -44,6 +44,13 @@ static void __make_cq_entry(int eid, u16 ret)
 /***
  * Queue managements
  */
+
+/* Queues are polled by the owning dispatcher; keep their state on its node */
+static inline int __queue_node(int qid)
+{
+	return nvmev_cpu_to_node(nvmev_vdev->config.cpu_nr_dispatchers[nvmev_get_dispatcher(qid)]);
+}
+
 static void __nvmev_admin_create_cq(int eid)
 {
 	struct nvmev_admin_queue *queue = nvmev_vdev->admin_q;
@@ -52,7 +59,7 @@ static void __nvmev_admin_create_cq(int eid)
 	unsigned int num_pages, i;
 	int dbs_idx;
 
-	cq = kzalloc(sizeof(struct nvmev_completion_queue), GFP_KERNEL);
+	cq = kzalloc_node(sizeof(struct nvmev_completion_queue), GFP_KERNEL, __queue_node(cmd->cqid));
 
 	cq->qid = cmd->cqid;
 
@@ -76,7 +83,8 @@ static void __nvmev_admin_create_cq(int eid)
 	WARN_ON(!cq->phys_contig);
 
 	num_pages = DIV_ROUND_UP(cq->queue_size * sizeof(struct nvme_completion), PAGE_SIZE);
-	cq->cq = kzalloc(sizeof(struct nvme_completion *) * num_pages, GFP_KERNEL);
+	cq->cq = kzalloc_node(sizeof(struct nvme_completion *) * num_pages, GFP_KERNEL,
+			      __queue_node(cq->qid));
 
 	if (pfn_valid(cmd->prp1 >> PAGE_SHIFT)) {
 		cq->mapped = NULL;
@@ -89,9 +97,14 @@ static void __nvmev_admin_create_cq(int eid)
 	}
 
 	nvmev_vdev->cqes[cq->qid] = cq;
+	set_bit(cq->qid, nvmev_vdev->dispatchers[nvmev_get_dispatcher(cq->qid)].cqs);
 
 	dbs_idx = cq->qid * 2 + 1;
 	nvmev_vdev->dbs[dbs_idx] = nvmev_vdev->old_dbs[dbs_idx] = 0;
+	if (nvmev_vdev->dbs_shadow) {
+		nvmev_vdev->dbs_shadow[dbs_idx] = 0;
+		nvmev_vdev->dbs_eventidx[dbs_idx] = -1;
+	}
 
 	__make_cq_entry(eid, NVME_SC_SUCCESS);
 }
@@ -105,9 +118,13 @@ static void __nvmev_admin_delete_cq(int eid)
 	qid = sq_entry(eid).delete_queue.qid;
 
 	cq = nvmev_vdev->cqes[qid];
-	nvmev_vdev->cqes[qid] = NULL;
+	clear_bit(qid, nvmev_vdev->dispatchers[nvmev_get_dispatcher(qid)].cqs);
+	WRITE_ONCE(nvmev_vdev->cqes[qid], NULL);
 
 	if (cq) {
+		/* Other dispatchers and IO workers may still be posting to it */
+		synchronize_srcu(&nvmev_vdev->queue_srcu);
+
 		kfree(cq->cq);
 		if (cq->mapped)
 			memunmap(cq->mapped);
@@ -125,12 +142,13 @@ static void __nvmev_admin_create_sq(int eid)
 	unsigned int num_pages, i;
 	int dbs_idx;
 
-	sq = kzalloc(sizeof(struct nvmev_submission_queue), GFP_KERNEL);
+	sq = kzalloc_node(sizeof(struct nvmev_submission_queue), GFP_KERNEL, __queue_node(cmd->sqid));
 
 	sq->qid = cmd->sqid;
 	sq->cqid = cmd->cqid;
 
-	sq->priority = cmd->sq_flags & 0xFFFE;
+	/* QPRIO is only meaningful with weighted round robin, kept regardless */
+	sq->priority = (cmd->sq_flags & NVME_SQ_PRIO_LOW) >> 1;
 	sq->queue_size = cmd->qsize + 1;
 
 	/* TODO Physically non-contiguous prp list */
@@ -138,7 +156,8 @@ static void __nvmev_admin_create_sq(int eid)
 	WARN_ON(!sq->phys_contig);
 
 	num_pages = DIV_ROUND_UP(sq->queue_size * sizeof(struct nvme_command), PAGE_SIZE);
-	sq->sq = kzalloc(sizeof(struct nvme_command *) * num_pages, GFP_KERNEL);
+	sq->sq = kzalloc_node(sizeof(struct nvme_command *) * num_pages, GFP_KERNEL,
+			      __queue_node(sq->qid));
 
 	if (pfn_valid(cmd->prp1 >> PAGE_SHIFT)) {
 		sq->mapped = NULL;
@@ -151,10 +170,15 @@ static void __nvmev_admin_create_sq(int eid)
 	}
 
 	nvmev_vdev->sqes[sq->qid] = sq;
+	set_bit(sq->qid, nvmev_vdev->dispatchers[nvmev_get_dispatcher(sq->qid)].sqs);
 
 	dbs_idx = sq->qid * 2;
 	nvmev_vdev->dbs[dbs_idx] = 0;
 	nvmev_vdev->old_dbs[dbs_idx] = 0;
+	if (nvmev_vdev->dbs_shadow) {
+		nvmev_vdev->dbs_shadow[dbs_idx] = 0;
+		nvmev_vdev->dbs_eventidx[dbs_idx] = -1;
+	}
 
 	__make_cq_entry(eid, NVME_SC_SUCCESS);
 }
@@ -169,9 +193,13 @@ static void __nvmev_admin_delete_sq(int eid)
 	qid = cmd->qid;
 
 	sq = nvmev_vdev->sqes[qid];
-	nvmev_vdev->sqes[qid] = NULL;
+	clear_bit(qid, nvmev_vdev->dispatchers[nvmev_get_dispatcher(qid)].sqs);
+	WRITE_ONCE(nvmev_vdev->sqes[qid], NULL);
 
 	if (sq) {
+		/* The dispatcher owning it may be fetching from it */
+		synchronize_srcu(&nvmev_vdev->queue_srcu);
+
 		kfree(sq->sq);
 		if (sq->mapped)
 			memunmap(sq->mapped);
@@ -435,6 +463,8 @@ static void __nvmev_admin_identify_ctrl(int eid)
 	ctrl->mdts = nvmev_vdev->mdts;
 	ctrl->sqes = 0x66;
 	ctrl->cqes = 0x44;
+	ctrl->oacs = NVME_CTRL_OACS_DBBUF_SUPP;
+	ctrl->sgls = NVME_CTRL_SGLS_SUPPORTED; /* for IO commands */
 
 	__make_cq_entry(eid, NVME_SC_SUCCESS);
 }
@@ -482,6 +512,11 @@ static void __nvmev_admin_set_features(int eid)
 
 	switch (cmd->fid) {
 	case NVME_FEAT_ARBITRATION:
+		nvmev_vdev->arb_burst = cmd->dword11 & 0x7;
+		nvmev_vdev->arb_weights[NVMEV_SQ_PRIO_LOW] = (cmd->dword11 >> 8) & 0xFF;
+		nvmev_vdev->arb_weights[NVMEV_SQ_PRIO_MEDIUM] = (cmd->dword11 >> 16) & 0xFF;
+		nvmev_vdev->arb_weights[NVMEV_SQ_PRIO_HIGH] = (cmd->dword11 >> 24) & 0xFF;
+		break;
 	case NVME_FEAT_POWER_MGMT:
 	case NVME_FEAT_LBA_RANGE:
 	case NVME_FEAT_TEMP_THRESH:
@@ -527,6 +562,11 @@ static void __nvmev_admin_get_features(int eid)
 
 	switch (cmd->fid) {
 	case NVME_FEAT_ARBITRATION:
+		result0 = nvmev_vdev->arb_burst |
+			  nvmev_vdev->arb_weights[NVMEV_SQ_PRIO_LOW] << 8 |
+			  nvmev_vdev->arb_weights[NVMEV_SQ_PRIO_MEDIUM] << 16 |
+			  nvmev_vdev->arb_weights[NVMEV_SQ_PRIO_HIGH] << 24;
+		break;
 	case NVME_FEAT_POWER_MGMT:
 	case NVME_FEAT_LBA_RANGE:
 	case NVME_FEAT_TEMP_THRESH:
@@ -553,6 +593,55 @@ static void __nvmev_admin_get_features(int eid)
 }
 
 
+/***
+ * Doorbell buffer config
+ */
+static void __nvmev_admin_dbbuf(int eid)
+{
+	struct nvmev_admin_queue *queue = nvmev_vdev->admin_q;
+	struct nvme_common_command *cmd = &sq_entry(eid).common;
+	u64 dbs_addr = cmd->prp1;
+	u64 eis_addr = cmd->prp2;
+	u32 *dbs_shadow, *dbs_eventidx;
+	int qid;
+
+	if (!dbs_addr || !eis_addr || (dbs_addr & ~PAGE_MASK) || (eis_addr & ~PAGE_MASK) ||
+	    !pfn_valid(dbs_addr >> PAGE_SHIFT) || !pfn_valid(eis_addr >> PAGE_SHIFT)) {
+		__make_cq_entry(eid, NVME_SC_INVALID_FIELD);
+		return;
+	}
+
+	dbs_shadow = prp_address(dbs_addr);
+	dbs_eventidx = prp_address(eis_addr);
+
+	/*
+	 * Seed the shadow doorbells with the doorbell values the host has written
+	 * so far so that the dispatchers do not see spurious updates on switching.
+	 * EventIdx is kept one behind the consumed doorbell value as the
+	 * dispatchers poll the shadow doorbells; the host never has to ring the
+	 * MMIO doorbells of I/O queues afterwards.
+	 */
+	for (qid = 1; qid <= NR_MAX_IO_QUEUE; qid++) {
+		int sq_idx = qid * 2;
+		int cq_idx = qid * 2 + 1;
+
+		dbs_shadow[sq_idx] = nvmev_vdev->dbs[sq_idx];
+		dbs_shadow[cq_idx] = nvmev_vdev->dbs[cq_idx];
+		dbs_eventidx[sq_idx] = nvmev_vdev->old_dbs[sq_idx] - 1;
+		dbs_eventidx[cq_idx] = nvmev_vdev->old_dbs[cq_idx] - 1;
+	}
+
+	WRITE_ONCE(nvmev_vdev->dbs_eventidx, dbs_eventidx);
+	smp_wmb(); /* Dispatchers shall see eventidx set whenever the shadow is set */
+	WRITE_ONCE(nvmev_vdev->dbs_shadow, dbs_shadow);
+
+	NVMEV_DEBUG("%s: shadow doorbells at 0x%llx, eventidx at 0x%llx\n", __func__, dbs_addr,
+		    eis_addr);
+
+	__make_cq_entry(eid, NVME_SC_SUCCESS);
+}
+
+
 /***
  * Misc
  */
@@ -601,6 +690,9 @@ static void __nvmev_proc_admin_req(int entry_id)
 	case nvme_admin_async_event:
 		__nvmev_admin_async_event(entry_id);
 		break;
+	case nvme_admin_dbbuf:
+		__nvmev_admin_dbbuf(entry_id);
+		break;
 	case nvme_admin_activate_fw:
 	case nvme_admin_download_fw:
 	case nvme_admin_format_nvm:
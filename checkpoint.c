@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/vmalloc.h>
+
+#include "nvmev.h"
+#include "checkpoint.h"
+
+#define CKPT_BUF_SIZE (1024 * 1024)
+
+/* Max. size of a file operation, well below MAX_RW_COUNT */
+#define CKPT_IO_SIZE (64 * 1024 * 1024)
+
+int ckpt_open(struct nvmev_ckpt *ckpt, const char *path, bool save)
+{
+	int flags = save ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+
+	*ckpt = (struct nvmev_ckpt){
+		.save = save,
+	};
+
+	ckpt->filp = filp_open(path, flags | O_LARGEFILE, 0600);
+	if (IS_ERR(ckpt->filp)) {
+		int ret = PTR_ERR(ckpt->filp);
+
+		ckpt->filp = NULL;
+		return ret;
+	}
+
+	ckpt->buf = vmalloc(CKPT_BUF_SIZE);
+	if (!ckpt->buf) {
+		filp_close(ckpt->filp, NULL);
+		ckpt->filp = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void __ckpt_write_file(struct nvmev_ckpt *ckpt, const void *data, size_t len)
+{
+	while (len && !ckpt->error) {
+		ssize_t ret = kernel_write(ckpt->filp, data, min_t(size_t, len, CKPT_IO_SIZE),
+					   &ckpt->pos);
+
+		if (ret <= 0) {
+			ckpt->error = ret ? ret : -EIO;
+			break;
+		}
+
+		data += ret;
+		len -= ret;
+	}
+}
+
+static void __ckpt_read_file(struct nvmev_ckpt *ckpt, void *data, size_t len)
+{
+	while (len && !ckpt->error) {
+		ssize_t ret = kernel_read(ckpt->filp, data, min_t(size_t, len, CKPT_IO_SIZE),
+					  &ckpt->pos);
+
+		if (ret <= 0) {
+			/* Truncated */
+			ckpt->error = ret ? ret : -ENODATA;
+			break;
+		}
+
+		data += ret;
+		len -= ret;
+	}
+}
+
+static void __ckpt_flush(struct nvmev_ckpt *ckpt)
+{
+	__ckpt_write_file(ckpt, ckpt->buf, ckpt->buf_len);
+	ckpt->buf_len = 0;
+}
+
+/* Returns the first error on the file, if any */
+int ckpt_close(struct nvmev_ckpt *ckpt)
+{
+	if (ckpt->save)
+		__ckpt_flush(ckpt);
+
+	vfree(ckpt->buf);
+	filp_close(ckpt->filp, NULL);
+
+	ckpt->buf = NULL;
+	ckpt->filp = NULL;
+
+	return ckpt->error;
+}
+
+void ckpt_write(struct nvmev_ckpt *ckpt, const void *data, size_t len)
+{
+	if (ckpt->buf_len + len > CKPT_BUF_SIZE)
+		__ckpt_flush(ckpt);
+
+	/* Large ones (e.g., mapping tables) go to the file directly */
+	if (len >= CKPT_BUF_SIZE) {
+		__ckpt_write_file(ckpt, data, len);
+		return;
+	}
+
+	memcpy(ckpt->buf + ckpt->buf_len, data, len);
+	ckpt->buf_len += len;
+}
+
+void ckpt_read(struct nvmev_ckpt *ckpt, void *data, size_t len)
+{
+	while (len && !ckpt->error) {
+		size_t n;
+
+		if (ckpt->buf_pos == ckpt->buf_len) {
+			ssize_t ret;
+
+			if (len >= CKPT_BUF_SIZE) {
+				__ckpt_read_file(ckpt, data, len);
+				return;
+			}
+
+			ret = kernel_read(ckpt->filp, ckpt->buf, CKPT_BUF_SIZE, &ckpt->pos);
+			if (ret <= 0) {
+				ckpt->error = ret ? ret : -ENODATA;
+				break;
+			}
+
+			ckpt->buf_len = ret;
+			ckpt->buf_pos = 0;
+		}
+
+		n = min(len, ckpt->buf_len - ckpt->buf_pos);
+		memcpy(data, ckpt->buf + ckpt->buf_pos, n);
+
+		ckpt->buf_pos += n;
+		data += n;
+		len -= n;
+	}
+}
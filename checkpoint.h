@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef _NVMEVIRT_CHECKPOINT_H
+#define _NVMEVIRT_CHECKPOINT_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+
+#define CKPT_MAGIC 0x54504b4356454d56ULL /* "VMEVCKPT" */
+#define CKPT_VERSION 2
+
+/*
+ * A checkpoint file starts with a struct ckpt_header, followed by each
+ * namespace as a struct ckpt_ns, the state of its FTL, and optionally its
+ * data of @data_size bytes.
+ */
+struct ckpt_header {
+	u64 magic;
+	u32 version;
+	u32 base_ssd;
+	u32 nr_ns;
+	u32 with_data;
+};
+
+struct ckpt_ns {
+	u32 type;
+	u32 nr_parts;
+	u64 size;
+	u64 data_size;
+};
+
+/*
+ * Sequential writer (or reader) of a checkpoint file. Small records are
+ * staged in @buf to spare a file operation each. The first error sticks in
+ * @error, so that callers may check it once at the end.
+ */
+struct nvmev_ckpt {
+	struct file *filp;
+	loff_t pos;
+	bool save;
+	int error;
+
+	void *buf;
+	size_t buf_len; /* staged bytes to save, or read bytes to restore */
+	size_t buf_pos; /* bytes of @buf already restored */
+};
+
+int ckpt_open(struct nvmev_ckpt *ckpt, const char *path, bool save);
+int ckpt_close(struct nvmev_ckpt *ckpt);
+void ckpt_write(struct nvmev_ckpt *ckpt, const void *data, size_t len);
+void ckpt_read(struct nvmev_ckpt *ckpt, void *data, size_t len);
+
+#endif /* _NVMEVIRT_CHECKPOINT_H */
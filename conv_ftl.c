@@ -6,6 +6,7 @@
 
 #include "nvmev.h"
 #include "conv_ftl.h"
+#include "nvmev_trace.h"
 
 static inline bool last_pg_in_wordline(struct conv_ftl *conv_ftl, struct ppa *ppa)
 {
@@ -39,9 +40,6 @@ static uint64_t ppa2pgidx(struct conv_ftl *conv_ftl, struct ppa *ppa)
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
 	uint64_t pgidx;
 
-	NVMEV_DEBUG_VERBOSE("%s: ch:%d, lun:%d, pl:%d, blk:%d, pg:%d\n", __func__,
-			ppa->g.ch, ppa->g.lun, ppa->g.pl, ppa->g.blk, ppa->g.pg);
-
 	pgidx = ppa->g.ch * spp->pgs_per_ch + ppa->g.lun * spp->pgs_per_lun +
 		ppa->g.pl * spp->pgs_per_pl + ppa->g.blk * spp->pgs_per_blk + ppa->g.pg;
 
@@ -116,7 +114,7 @@ static void init_lines(struct conv_ftl *conv_ftl)
 
 	lm->tt_lines = spp->blks_per_pl;
 	NVMEV_ASSERT(lm->tt_lines == spp->tt_lines);
-	lm->lines = vmalloc(sizeof(struct line) * lm->tt_lines);
+	lm->lines = vmalloc_node(sizeof(struct line) * lm->tt_lines, conv_ftl->ssd->node);
 
 	INIT_LIST_HEAD(&lm->free_line_list);
 	INIT_LIST_HEAD(&lm->full_line_list);
@@ -302,7 +300,7 @@ static void init_maptbl(struct conv_ftl *conv_ftl)
 	int i;
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
 
-	conv_ftl->maptbl = vmalloc(sizeof(struct ppa) * spp->tt_pgs);
+	conv_ftl->maptbl = vmalloc_node(sizeof(struct ppa) * spp->tt_pgs, conv_ftl->ssd->node);
 	for (i = 0; i < spp->tt_pgs; i++) {
 		conv_ftl->maptbl[i].ppa = UNMAPPED_PPA;
 	}
@@ -318,7 +316,7 @@ static void init_rmap(struct conv_ftl *conv_ftl)
 	int i;
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
 
-	conv_ftl->rmap = vmalloc(sizeof(uint64_t) * spp->tt_pgs);
+	conv_ftl->rmap = vmalloc_node(sizeof(uint64_t) * spp->tt_pgs, conv_ftl->ssd->node);
 	for (i = 0; i < spp->tt_pgs; i++) {
 		conv_ftl->rmap[i] = INVALID_LPN;
 	}
@@ -382,14 +380,15 @@ void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *
 	struct ssd *ssd;
 	uint32_t i;
 	const uint32_t nr_parts = SSD_PARTITIONS;
+	const int node = nvmev_cpu_to_node(cpu_nr_dispatcher);
 
 	ssd_init_params(&spp, size, nr_parts);
 	conv_init_params(&cpp);
 
-	conv_ftls = kmalloc(sizeof(struct conv_ftl) * nr_parts, GFP_KERNEL);
+	conv_ftls = kmalloc_node(sizeof(struct conv_ftl) * nr_parts, GFP_KERNEL, node);
 
 	for (i = 0; i < nr_parts; i++) {
-		ssd = kmalloc(sizeof(struct ssd), GFP_KERNEL);
+		ssd = kmalloc_node(sizeof(struct ssd), GFP_KERNEL, node);
 		ssd_init(ssd, &spp, cpu_nr_dispatcher);
 		conv_init_ftl(&conv_ftls[i], &cpp, ssd);
 	}
@@ -445,6 +444,231 @@ void conv_remove_namespace(struct nvmev_ns *ns)
 	ns->ftls = NULL;
 }
 
+/*
+ * A partition in a checkpoint; followed by the mapping tables, the counts of
+ * each line, and the state of each block and its pages. The line lists are
+ * not saved but rebuilt from the counts on restore.
+ */
+struct conv_ckpt_wp {
+	uint32_t line;
+	uint32_t ch;
+	uint32_t lun;
+	uint32_t pg;
+	uint32_t pl;
+};
+
+struct conv_ckpt {
+	uint64_t tt_pgs;
+	uint64_t tt_lines;
+	uint32_t pgs_per_blk;
+	int32_t write_credits;
+	uint32_t credits_to_refill;
+	struct conv_ckpt_wp wp;
+	struct conv_ckpt_wp gc_wp;
+};
+
+struct conv_ckpt_blk {
+	int32_t ipc;
+	int32_t vpc;
+	int32_t erase_cnt;
+	int32_t wp;
+};
+
+static void __save_wp(struct conv_ckpt_wp *ckpt_wp, struct write_pointer *wp)
+{
+	*ckpt_wp = (struct conv_ckpt_wp){
+		.line = wp->curline->id,
+		.ch = wp->ch,
+		.lun = wp->lun,
+		.pg = wp->pg,
+		.pl = wp->pl,
+	};
+}
+
+static void __restore_wp(struct conv_ftl *conv_ftl, struct write_pointer *wp,
+			 struct conv_ckpt_wp *ckpt_wp)
+{
+	*wp = (struct write_pointer){
+		.curline = &conv_ftl->lm.lines[ckpt_wp->line],
+		.ch = ckpt_wp->ch,
+		.lun = ckpt_wp->lun,
+		.pg = ckpt_wp->pg,
+		.blk = ckpt_wp->line,
+		.pl = ckpt_wp->pl,
+	};
+}
+
+/* Save or restore the state of each block and its pages, as @ckpt goes */
+static void __ckpt_blocks(struct conv_ftl *conv_ftl, struct nvmev_ckpt *ckpt)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	int ch, lun, pl, b, i;
+
+	for (ch = 0; ch < spp->nchs; ch++) {
+		for (lun = 0; lun < spp->luns_per_ch; lun++) {
+			for (pl = 0; pl < spp->pls_per_lun; pl++) {
+				for (b = 0; b < spp->blks_per_pl; b++) {
+					struct nand_block *blk =
+						&conv_ftl->ssd->ch[ch].lun[lun].pl[pl].blk[b];
+					struct conv_ckpt_blk ckpt_blk = {
+						.ipc = blk->ipc,
+						.vpc = blk->vpc,
+						.erase_cnt = blk->erase_cnt,
+						.wp = blk->wp,
+					};
+
+					if (ckpt->save) {
+						ckpt_write(ckpt, &ckpt_blk, sizeof(ckpt_blk));
+					} else {
+						ckpt_read(ckpt, &ckpt_blk, sizeof(ckpt_blk));
+						blk->ipc = ckpt_blk.ipc;
+						blk->vpc = ckpt_blk.vpc;
+						blk->erase_cnt = ckpt_blk.erase_cnt;
+						blk->wp = ckpt_blk.wp;
+					}
+
+					for (i = 0; i < blk->npgs; i++) {
+						uint8_t status = blk->pg[i].status;
+
+						if (ckpt->save) {
+							ckpt_write(ckpt, &status, sizeof(status));
+						} else {
+							ckpt_read(ckpt, &status, sizeof(status));
+							blk->pg[i].status = status;
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+static void conv_save_ftl(struct conv_ftl *conv_ftl, struct nvmev_ckpt *ckpt)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct line_mgmt *lm = &conv_ftl->lm;
+	struct conv_ckpt hdr = {
+		.tt_pgs = spp->tt_pgs,
+		.tt_lines = lm->tt_lines,
+		.pgs_per_blk = spp->pgs_per_blk,
+		.write_credits = conv_ftl->wfc.write_credits,
+		.credits_to_refill = conv_ftl->wfc.credits_to_refill,
+	};
+	int i;
+
+	__save_wp(&hdr.wp, &conv_ftl->wp);
+	__save_wp(&hdr.gc_wp, &conv_ftl->gc_wp);
+
+	ckpt_write(ckpt, &hdr, sizeof(hdr));
+	ckpt_write(ckpt, conv_ftl->maptbl, sizeof(struct ppa) * spp->tt_pgs);
+	ckpt_write(ckpt, conv_ftl->rmap, sizeof(uint64_t) * spp->tt_pgs);
+
+	for (i = 0; i < lm->tt_lines; i++) {
+		int32_t cnt[2] = { lm->lines[i].ipc, lm->lines[i].vpc };
+
+		ckpt_write(ckpt, cnt, sizeof(cnt));
+	}
+
+	__ckpt_blocks(conv_ftl, ckpt);
+}
+
+static int conv_restore_ftl(struct conv_ftl *conv_ftl, struct nvmev_ckpt *ckpt)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct line_mgmt *lm = &conv_ftl->lm;
+	struct conv_ckpt hdr;
+	int i;
+
+	ckpt_read(ckpt, &hdr, sizeof(hdr));
+	if (ckpt->error)
+		return ckpt->error;
+
+	if (hdr.tt_pgs != spp->tt_pgs || hdr.tt_lines != lm->tt_lines ||
+	    hdr.pgs_per_blk != spp->pgs_per_blk || hdr.wp.line >= lm->tt_lines ||
+	    hdr.gc_wp.line >= lm->tt_lines) {
+		NVMEV_ERROR("Checkpoint does not match the geometry of the FTL\n");
+		return -EINVAL;
+	}
+
+	ckpt_read(ckpt, conv_ftl->maptbl, sizeof(struct ppa) * spp->tt_pgs);
+	ckpt_read(ckpt, conv_ftl->rmap, sizeof(uint64_t) * spp->tt_pgs);
+
+	for (i = 0; i < lm->tt_lines; i++) {
+		int32_t cnt[2];
+
+		ckpt_read(ckpt, cnt, sizeof(cnt));
+		lm->lines[i].ipc = cnt[0];
+		lm->lines[i].vpc = cnt[1];
+	}
+
+	__ckpt_blocks(conv_ftl, ckpt);
+
+	if (ckpt->error)
+		return ckpt->error;
+
+	conv_ftl->wfc.write_credits = hdr.write_credits;
+	conv_ftl->wfc.credits_to_refill = hdr.credits_to_refill;
+	__restore_wp(conv_ftl, &conv_ftl->wp, &hdr.wp);
+	__restore_wp(conv_ftl, &conv_ftl->gc_wp, &hdr.gc_wp);
+
+	/*
+	 * Rebuild the line lists as advance_write_pointer() and the GC left
+	 * them: lines all valid are full, the other written ones are victims.
+	 */
+	INIT_LIST_HEAD(&lm->free_line_list);
+	INIT_LIST_HEAD(&lm->full_line_list);
+	lm->free_line_cnt = 0;
+	lm->full_line_cnt = 0;
+	lm->victim_line_cnt = 0;
+
+	for (i = 0; i < lm->tt_lines; i++) {
+		struct line *line = &lm->lines[i];
+
+		INIT_LIST_HEAD(&line->entry);
+		line->pos = 0;
+
+		if (line == conv_ftl->wp.curline || line == conv_ftl->gc_wp.curline)
+			continue;
+
+		if (line->vpc == 0 && line->ipc == 0) {
+			list_add_tail(&line->entry, &lm->free_line_list);
+			lm->free_line_cnt++;
+		} else if (line->ipc == 0) {
+			list_add_tail(&line->entry, &lm->full_line_list);
+			lm->full_line_cnt++;
+		} else {
+			pqueue_insert(lm->victim_line_pq, line);
+			lm->victim_line_cnt++;
+		}
+	}
+
+	return 0;
+}
+
+void conv_save_namespace(struct nvmev_ns *ns, struct nvmev_ckpt *ckpt)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	uint32_t i;
+
+	for (i = 0; i < ns->nr_parts; i++)
+		conv_save_ftl(&conv_ftls[i], ckpt);
+}
+
+int conv_restore_namespace(struct nvmev_ns *ns, struct nvmev_ckpt *ckpt)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	uint32_t i;
+	int ret;
+
+	for (i = 0; i < ns->nr_parts; i++) {
+		ret = conv_restore_ftl(&conv_ftls[i], ckpt);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 static inline bool valid_ppa(struct conv_ftl *conv_ftl, struct ppa *ppa)
 {
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
@@ -763,9 +987,7 @@ static int do_gc(struct conv_ftl *conv_ftl, bool force)
 	}
 
 	ppa.g.blk = victim_line->id;
-	NVMEV_DEBUG_VERBOSE("GC-ing line:%d,ipc=%d(%d),victim=%d,full=%d,free=%d\n", ppa.g.blk,
-		    victim_line->ipc, victim_line->vpc, conv_ftl->lm.victim_line_cnt,
-		    conv_ftl->lm.full_line_cnt, conv_ftl->lm.free_line_cnt);
+	trace_nvmev_gc(ppa.g.blk, victim_line->ipc, victim_line->vpc, conv_ftl->lm.free_line_cnt);
 
 	conv_ftl->wfc.credits_to_refill = victim_line->ipc;
 
@@ -857,7 +1079,6 @@ static bool conv_read(struct nvmev_ns *ns, struct nvmev_request *req, struct nvm
 	};
 
 	NVMEV_ASSERT(conv_ftls);
-	NVMEV_DEBUG_VERBOSE("%s: start_lpn=%lld, len=%lld, end_lpn=%lld", __func__, start_lpn, nr_lba, end_lpn);
 	if ((end_lpn / nr_parts) >= spp->tt_pgs) {
 		NVMEV_ERROR("%s: lpn passed FTL range (start_lpn=%lld > tt_pgs=%ld)\n", __func__,
 			    start_lpn, spp->tt_pgs);
@@ -951,7 +1172,6 @@ static bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nv
 		.xfer_size = spp->pgsz * spp->pgs_per_oneshotpg,
 	};
 
-	NVMEV_DEBUG_VERBOSE("%s: start_lpn=%lld, len=%lld, end_lpn=%lld", __func__, start_lpn, nr_lba, end_lpn);
 	if ((end_lpn / nr_parts) >= spp->tt_pgs) {
 		NVMEV_ERROR("%s: lpn passed FTL range (start_lpn=%lld > tt_pgs=%ld)\n",
 				__func__, start_lpn, spp->tt_pgs);
@@ -1036,8 +1256,6 @@ static void conv_flush(struct nvmev_ns *ns, struct nvmev_request *req, struct nv
 		latest = max(latest, ssd_next_idle_time(conv_ftls[i].ssd));
 	}
 
-	NVMEV_DEBUG_VERBOSE("%s: latency=%llu\n", __func__, latest - start);
-
 	ret->status = NVME_SC_SUCCESS;
 	ret->nsecs_target = latest;
 	return;
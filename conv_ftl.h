@@ -7,6 +7,7 @@
 #include "pqueue/pqueue.h"
 #include "ssd_config.h"
 #include "ssd.h"
+#include "checkpoint.h"
 
 struct convparams {
 	uint32_t gc_thres_lines;
@@ -72,6 +73,9 @@ void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *
 
 void conv_remove_namespace(struct nvmev_ns *ns);
 
+void conv_save_namespace(struct nvmev_ns *ns, struct nvmev_ckpt *ckpt);
+int conv_restore_namespace(struct nvmev_ns *ns, struct nvmev_ckpt *ckpt);
+
 bool conv_proc_nvme_io_cmd(struct nvmev_ns *ns, struct nvmev_request *req,
 			   struct nvmev_result *ret);
 
@@ -3,9 +3,32 @@
 #ifndef _LIB_DMA_H
 #define _LIB_DMA_H
 
+#include <linux/atomic.h>
+#include <linux/types.h>
+
+#define NR_MAX_DMA_CHANS 16
+
+/*
+ * Transfers of a command, striped over the DMA channels and completed as a
+ * whole. @done is called once all of them finish, from the completion
+ * context of the DMA engine (or from ioat_dma_batch_submit() if there is
+ * nothing in flight by then).
+ */
+struct ioat_dma_batch {
+	atomic_t nr_pending; /* plus one held by the submitter */
+	int error;
+	unsigned long chans; /* channels to issue */
+	unsigned int turn;
+	void (*done)(struct ioat_dma_batch *batch);
+};
+
 // DMA Init, Final Function
 int ioat_dma_chan_set(const char *val);
-int ioat_dma_submit(dma_addr_t src_addr, dma_addr_t dst_addr, unsigned int size);
 void ioat_dma_cleanup(void);
 
+void ioat_dma_batch_init(struct ioat_dma_batch *batch, void (*done)(struct ioat_dma_batch *));
+size_t ioat_dma_batch_add(struct ioat_dma_batch *batch, dma_addr_t src_addr, dma_addr_t dst_addr,
+			  size_t size);
+void ioat_dma_batch_submit(struct ioat_dma_batch *batch);
+
 #endif /* _LIB_DMA_H */
@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/sched/clock.h>
+
+#include "nvmev.h"
+#include "idle.h"
+
+#define IDLE_MIN_SLEEP_NS (10 * 1000ULL)
+
+void nvmev_idle_reset_stat(struct nvmev_idle *idle)
+{
+	memset(idle->nsecs_in_state, 0, sizeof(idle->nsecs_in_state));
+	idle->nr_sleeps = 0;
+	idle->total_wake_penalty = 0;
+	idle->max_wake_penalty = 0;
+}
+
+void nvmev_idle_init(struct nvmev_idle *idle)
+{
+	idle->state = NVMEV_IDLE_SPIN;
+	idle->last_update = local_clock();
+	idle->idle_since = 0;
+	idle->avg_gap = 0;
+	idle->sleeping = false;
+
+	nvmev_idle_reset_stat(idle);
+}
+
+/*
+ * The caller sets the task state; sleep until woken up if @nsecs is ULLONG_MAX.
+ * The hrtimer may fire up to @slack later to be coalesced with others.
+ */
+static void __idle_sleep(struct nvmev_idle *idle, unsigned long long nsecs,
+			 unsigned long long slack)
+{
+	ktime_t expires = ns_to_ktime(nsecs);
+	unsigned long long start = local_clock();
+	unsigned long long slept;
+
+	if (nsecs == ULLONG_MAX) {
+		schedule_hrtimeout_range(NULL, 0, HRTIMER_MODE_REL);
+		idle->nr_sleeps++;
+		return;
+	}
+
+	schedule_hrtimeout_range(&expires, slack, HRTIMER_MODE_REL);
+
+	slept = local_clock() - start;
+	idle->nr_sleeps++;
+	if (slept > nsecs) {
+		idle->total_wake_penalty += slept - nsecs;
+		idle->max_wake_penalty = max(idle->max_wake_penalty, slept - nsecs);
+	}
+}
+
+/*
+ * Called once per polling loop. @active tells whether the loop had anything
+ * to do (or still has work pending); if not, the calling thread spins, yields
+ * or sleeps depending on how long it has been idle. If @pending is given, a
+ * producer may cut the sleep short with nvmev_idle_kick() as below.
+ */
+void nvmev_idle(struct nvmev_idle *idle, bool active, bool (*pending)(void *), void *data)
+{
+	struct nvmev_config *cfg = &nvmev_vdev->config;
+	unsigned long long now = local_clock();
+	unsigned long long spin_nsecs = cfg->idle_spin_us * 1000ULL;
+	unsigned long long yield_nsecs = cfg->idle_yield_us * 1000ULL;
+	unsigned long long sleep_nsecs = cfg->idle_sleep_us * 1000ULL;
+	unsigned long long idle_nsecs;
+
+	idle->nsecs_in_state[idle->state] += now - idle->last_update;
+	idle->last_update = now;
+
+	if (active) {
+		if (idle->idle_since) {
+			unsigned long long gap = now - idle->idle_since;
+
+			idle->avg_gap = idle->avg_gap ? (idle->avg_gap * 7 + gap) >> 3 : gap;
+			idle->idle_since = 0;
+		}
+		idle->state = NVMEV_IDLE_SPIN;
+		cond_resched();
+		return;
+	}
+
+	if (!idle->idle_since)
+		idle->idle_since = now;
+	idle_nsecs = now - idle->idle_since;
+
+	/* Arrivals are too sparse to be caught by spinning; give up the CPU early */
+	if (idle->avg_gap > spin_nsecs)
+		spin_nsecs >>= 3;
+
+	if (idle_nsecs < spin_nsecs) {
+		idle->state = NVMEV_IDLE_SPIN;
+		cond_resched();
+	} else if (idle_nsecs < spin_nsecs + yield_nsecs || sleep_nsecs == 0) {
+		idle->state = NVMEV_IDLE_YIELD;
+		yield();
+	} else {
+		unsigned long long nsecs = clamp(idle_nsecs >> 4, IDLE_MIN_SLEEP_NS, sleep_nsecs);
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (pending) {
+			smp_store_mb(idle->sleeping, true);
+			if (pending(data) || kthread_should_stop()) {
+				__set_current_state(TASK_RUNNING);
+				WRITE_ONCE(idle->sleeping, false);
+				return;
+			}
+		}
+
+		idle->state = NVMEV_IDLE_SLEEP;
+		__idle_sleep(idle, nsecs, nsecs >> 4);
+		WRITE_ONCE(idle->sleeping, false);
+	}
+}
+
+/*
+ * Variant for threads that know when they have to be up next, @nsecs_wait
+ * from now (ULLONG_MAX if nothing is scheduled). The thread spins only
+ * within @spin_nsecs before it and sleeps on an hrtimer until then. A
+ * producer can cut the sleep short with nvmev_idle_kick(); @pending is
+ * checked once more after announcing the sleep not to miss such a kick.
+ */
+void nvmev_idle_until(struct nvmev_idle *idle, unsigned long long nsecs_wait,
+		      unsigned long long spin_nsecs, bool (*pending)(void *), void *data)
+{
+	unsigned long long now = local_clock();
+
+	idle->nsecs_in_state[idle->state] += now - idle->last_update;
+	idle->last_update = now;
+
+	if (nsecs_wait <= spin_nsecs) {
+		idle->state = NVMEV_IDLE_SPIN;
+		cond_resched();
+		return;
+	}
+
+	set_current_state(TASK_INTERRUPTIBLE);
+	smp_store_mb(idle->sleeping, true);
+
+	if (pending(data) || kthread_should_stop()) {
+		__set_current_state(TASK_RUNNING);
+	} else {
+		idle->state = NVMEV_IDLE_SLEEP;
+		/* Keep the slack within the spin window not to overshoot the deadline */
+		__idle_sleep(idle, nsecs_wait == ULLONG_MAX ? ULLONG_MAX : nsecs_wait - spin_nsecs,
+			     spin_nsecs >> 1);
+	}
+
+	WRITE_ONCE(idle->sleeping, false);
+}
+
+/* Returns true if @task was (about to be) sleeping */
+bool nvmev_idle_kick(struct nvmev_idle *idle, struct task_struct *task)
+{
+	smp_mb(); /* Pairs with smp_store_mb() in nvmev_idle{,_until}() */
+	if (!READ_ONCE(idle->sleeping))
+		return false;
+
+	wake_up_process(task);
+	return true;
+}
@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef _NVMEVIRT_IDLE_H
+#define _NVMEVIRT_IDLE_H
+
+#include <linux/types.h>
+
+struct task_struct;
+
+enum {
+	NVMEV_IDLE_SPIN = 0,
+	NVMEV_IDLE_YIELD,
+	NVMEV_IDLE_SLEEP,
+	NR_NVMEV_IDLE_STATES,
+};
+
+/*
+ * Per-thread state of the adaptive idle policy shared by the dispatchers and
+ * the IO workers. A polling thread that finds nothing to do spins for a
+ * while, then yields the CPU, and finally sleeps on an hrtimer with a slice
+ * that grows with the length of the idle period. The spin window shrinks
+ * when the observed idle periods (i.e., inter-arrival gaps) are too long to
+ * be covered by spinning.
+ */
+struct nvmev_idle {
+	int state;
+
+	unsigned long long last_update; /* last call, for per-state accounting */
+	unsigned long long idle_since; /* 0 when active */
+	unsigned long long avg_gap; /* EWMA of idle periods in ns */
+
+	bool sleeping; /* for nvmev_idle_kick() */
+
+	unsigned long long nsecs_in_state[NR_NVMEV_IDLE_STATES];
+	unsigned long long nr_sleeps;
+	unsigned long long total_wake_penalty; /* oversleep on wake-ups in ns */
+	unsigned long long max_wake_penalty;
+};
+
+void nvmev_idle_init(struct nvmev_idle *idle);
+void nvmev_idle_reset_stat(struct nvmev_idle *idle);
+void nvmev_idle(struct nvmev_idle *idle, bool active, bool (*pending)(void *), void *data);
+void nvmev_idle_until(struct nvmev_idle *idle, unsigned long long nsecs_wait,
+		      unsigned long long spin_nsecs, bool (*pending)(void *), void *data);
+bool nvmev_idle_kick(struct nvmev_idle *idle, struct task_struct *task);
+
+#endif
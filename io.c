@@ -4,10 +4,12 @@
 #include <linux/kthread.h>
 #include <linux/ktime.h>
 #include <linux/highmem.h>
+#include <linux/log2.h>
 #include <linux/sched/clock.h>
 
 #include "nvmev.h"
 #include "dma.h"
+#include "sgl.h"
 
 #if (SUPPORTED_SSD_TYPE(CONV) || SUPPORTED_SSD_TYPE(ZNS))
 #include "ssd.h"
@@ -15,20 +17,42 @@
 struct buffer;
 #endif
 
-#undef PERF_DEBUG
+#define CREATE_TRACE_POINTS
+#include "nvmev_trace.h"
+
+/* Max. number of SQEs fetched and processed by the dispatcher at once */
+#define NR_SQ_BATCH 32
 
 #define sq_entry(entry_id) sq->sq[SQ_ENTRY_TO_PAGE_NUM(entry_id)][SQ_ENTRY_TO_PAGE_OFFSET(entry_id)]
 #define cq_entry(entry_id) cq->cq[CQ_ENTRY_TO_PAGE_NUM(entry_id)][CQ_ENTRY_TO_PAGE_OFFSET(entry_id)]
 
 extern bool io_using_dma;
 
+static inline unsigned int __nr_io_workers_of(unsigned int dispatcher_id)
+{
+	unsigned int nr_dispatchers = nvmev_vdev->config.nr_dispatchers;
+
+	return (nvmev_vdev->config.nr_io_workers - dispatcher_id + nr_dispatchers - 1) /
+	       nr_dispatchers;
+}
+
+/*
+ * IO workers are partitioned among the dispatchers in a round-robin fashion;
+ * worker i belongs to dispatcher (i % nr_dispatchers). Requests from an SQ
+ * are always handed to a worker of the dispatcher owning that SQ so that
+ * the free/io lists of a worker have a single producer.
+ */
 static inline unsigned int __get_io_worker(int sqid)
 {
+	unsigned int nr_dispatchers = nvmev_vdev->config.nr_dispatchers;
+	unsigned int dispatcher_id = nvmev_get_dispatcher(sqid);
 #ifdef CONFIG_NVMEV_IO_WORKER_BY_SQ
-	return (sqid - 1) % nvmev_vdev->config.nr_io_workers;
+	unsigned int turn = ((sqid - 1) / nr_dispatchers) % __nr_io_workers_of(dispatcher_id);
 #else
-	return nvmev_vdev->io_worker_turn;
+	unsigned int turn = nvmev_vdev->dispatchers[dispatcher_id].io_worker_turn;
 #endif
+
+	return dispatcher_id + turn * nr_dispatchers;
 }
 
 static inline unsigned long long __get_wallclock(void)
@@ -46,500 +70,1112 @@ static inline size_t __cmd_io_size(struct nvme_rw_command *cmd)
 	return (cmd->length + 1) << LBA_BITS;
 }
 
-static unsigned int __do_perform_io(int sqid, int sq_entry)
+/*
+ * Kernel address of @paddr outside of the direct map. The page containing it
+ * stays mapped until the window is evicted by a later call on @cache, so
+ * repeated requests to the same buffers do not set up mappings each time.
+ * Also used to read the SGL segments of the commands being copied.
+ */
+void *nvmev_remap(struct nvmev_remap_cache *cache, u64 paddr)
+{
+	struct nvmev_remap_window *win = &cache->windows[cache->mru];
+	u64 base = paddr & ~((u64)REMAP_WINDOW_SIZE - 1);
+	unsigned int i, victim = 0;
+
+	if (win->vaddr && paddr >= win->paddr && paddr < win->paddr + win->size)
+		goto hit;
+
+	for (i = 0; i < NR_REMAP_WINDOWS; i++) {
+		win = &cache->windows[i];
+		if (win->vaddr && paddr >= win->paddr && paddr < win->paddr + win->size) {
+			cache->mru = i;
+			goto hit;
+		}
+		if (!win->vaddr || (cache->windows[victim].vaddr &&
+				    win->last_used < cache->windows[victim].last_used))
+			victim = i;
+	}
+
+	win = &cache->windows[victim];
+	if (win->vaddr)
+		memunmap(win->vaddr);
+
+	/* memremap() refuses ranges mixing RAM and others; fall back to a page */
+	win->vaddr = NULL;
+	if (region_intersects(base, REMAP_WINDOW_SIZE, IORESOURCE_SYSTEM_RAM, IORES_DESC_NONE) ==
+	    REGION_DISJOINT) {
+		win->paddr = base;
+		win->size = REMAP_WINDOW_SIZE;
+		win->vaddr = memremap(base, REMAP_WINDOW_SIZE, MEMREMAP_WT);
+	}
+	if (!win->vaddr) {
+		win->paddr = paddr & PAGE_MASK;
+		win->size = PAGE_SIZE;
+		win->vaddr = memremap(win->paddr, PAGE_SIZE, MEMREMAP_WT);
+	}
+	if (!win->vaddr) {
+		NVMEV_ERROR("Cannot map host memory at 0x%llx\n", paddr);
+		return NULL;
+	}
+
+	cache->mru = victim;
+	cache->nr_remaps++;
+hit:
+	win->last_used = ++cache->clock;
+	return win->vaddr + (paddr - win->paddr);
+}
+
+static void __remap_cache_release(struct nvmev_remap_cache *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < NR_REMAP_WINDOWS; i++) {
+		if (cache->windows[i].vaddr)
+			memunmap(cache->windows[i].vaddr);
+	}
+	memset(cache, 0, sizeof(*cache));
+}
+
+/* Read the PRP entry at @addr of the host */
+static bool __read_prp_entry(struct nvmev_remap_cache *cache, u64 addr, u64 *entry)
+{
+	u64 *vaddr;
+
+	if (pfn_valid(PRP_PFN(addr))) {
+		vaddr = kmap_local_pfn(PRP_PFN(addr));
+		*entry = vaddr[(addr & PAGE_OFFSET_MASK) / sizeof(u64)];
+		kunmap_local(vaddr);
+		return true;
+	}
+
+	vaddr = nvmev_remap(cache, addr);
+	if (!vaddr)
+		return false;
+
+	*entry = *vaddr;
+	return true;
+}
+
+/*
+ * Walks the PRP entries of a command. A PRP list fills its page up to the
+ * end, and if more entries follow, the last one in the page points to the
+ * next page of the list instead. The entries are read one at a time through
+ * the direct map or the remap cache of the walker, so that nothing but the
+ * iterator itself is kept between them.
+ */
+struct prp_iter {
+	u64 prp1;
+	u64 prp2;
+	size_t remaining;
+	unsigned int nr_prps;
+	u64 next; /* address of the next entry in the PRP list */
+};
+
+static void __prp_iter_init(struct prp_iter *iter, struct nvme_rw_command *cmd)
+{
+	iter->prp1 = cmd->prp1;
+	iter->prp2 = cmd->prp2;
+	iter->remaining = __cmd_io_size(cmd);
+	iter->nr_prps = 0;
+	iter->next = cmd->prp2;
+}
+
+/*
+ * Get the next piece of the data in @paddr and @len, which does not cross a
+ * page. @len is 0 at the end of the data. Returns an NVMe status code.
+ */
+static unsigned int __prp_iter_next(struct prp_iter *iter, struct nvmev_remap_cache *cache,
+				    u64 *paddr, size_t *len)
+{
+	if (iter->remaining == 0) {
+		*len = 0;
+		return NVME_SC_SUCCESS;
+	}
+
+	if (iter->nr_prps == 0) {
+		*paddr = iter->prp1;
+	} else if (iter->nr_prps == 1 && iter->remaining <= PAGE_SIZE) {
+		*paddr = iter->prp2;
+	} else {
+		/* Follow the chain unless this is the last entry of the command */
+		if ((iter->next & PAGE_OFFSET_MASK) == PAGE_SIZE - sizeof(u64) &&
+		    iter->remaining > PAGE_SIZE) {
+			if (!__read_prp_entry(cache, iter->next, &iter->next))
+				return NVME_SC_DATA_XFER_ERROR;
+		}
+
+		if (!__read_prp_entry(cache, iter->next, paddr))
+			return NVME_SC_DATA_XFER_ERROR;
+		iter->next += sizeof(u64);
+	}
+	iter->nr_prps++;
+
+	/* Only the first one may start in the middle of a page */
+	*len = min_t(size_t, iter->remaining, PAGE_SIZE - (*paddr & PAGE_OFFSET_MASK));
+	iter->remaining -= *len;
+
+	return NVME_SC_SUCCESS;
+}
+
+/*
+ * Skip the whole pages of the data before @from, as a chunk of a split copy
+ * starts there. The PRP list is indexed directly; only the pointers chaining
+ * its pages are read on the way. Returns an NVMe status code.
+ */
+static unsigned int __prp_iter_seek(struct prp_iter *iter, struct nvmev_remap_cache *cache,
+				    size_t from)
+{
+	size_t first = PAGE_SIZE - (iter->prp1 & PAGE_OFFSET_MASK);
+	unsigned int skip;
+
+	if (from < first)
+		return NVME_SC_SUCCESS;
+
+	/* PRP1, and the entries of the list before the one holding @from */
+	skip = (from - first) / PAGE_SIZE;
+	iter->remaining -= first + (size_t)skip * PAGE_SIZE;
+	iter->nr_prps = 1 + skip;
+
+	while (skip) {
+		unsigned int slots = (PAGE_SIZE - (iter->next & PAGE_OFFSET_MASK)) / sizeof(u64);
+
+		if (skip < slots) {
+			iter->next += skip * sizeof(u64);
+			break;
+		}
+
+		/* More than a page follows the last slot, which chains the next page */
+		iter->next += (slots - 1) * sizeof(u64);
+		skip -= slots - 1;
+		if (!__read_prp_entry(cache, iter->next, &iter->next))
+			return NVME_SC_DATA_XFER_ERROR;
+	}
+
+	return NVME_SC_SUCCESS;
+}
+
+/*
+ * Commands of at least nt_write_kb (nt_read_kb) are copied with non-temporal
+ * stores, so that a stream of them does not evict the working set of the
+ * host and the metadata of the emulator from the cache.
+ */
+static inline bool __nt_copy(struct nvme_rw_command *cmd)
+{
+	unsigned int kb = cmd->opcode == nvme_cmd_read ? READ_ONCE(nvmev_vdev->config.nt_read_kb) :
+							 READ_ONCE(nvmev_vdev->config.nt_write_kb);
+
+	return kb && __cmd_io_size(cmd) >= ((size_t)kb << 10);
+}
+
+static void __copy_run(struct nvme_rw_command *cmd, void *storage, void *vaddr, size_t len)
+{
+	bool nt = __nt_copy(cmd);
+
+	if (cmd->opcode == nvme_cmd_write || cmd->opcode == nvme_cmd_zone_append) {
+		if (nt)
+			memcpy_flushcache(storage, vaddr, len);
+		else
+			memcpy(storage, vaddr, len);
+	} else if (cmd->opcode == nvme_cmd_read) {
+		if (nt)
+			memcpy_flushcache(vaddr, storage, len);
+		else
+			memcpy(vaddr, storage, len);
+	}
+}
+
+/*
+ * Copy a page at a time through a temporary mapping. Used where the host
+ * memory is not entirely covered by the direct map, and as the baseline of
+ * copy_bench.
+ */
+static unsigned int __do_perform_io_by_page(struct nvme_rw_command *cmd,
+					    struct nvmev_remap_cache *cache)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	struct nvme_rw_command *cmd = &sq_entry(sq_entry).rw;
 	size_t offset;
-	size_t length, remaining;
-	int prp_offs = 0;
-	int prp2_offs = 0;
 	u64 paddr;
-	u64 *paddr_list = NULL;
 	size_t nsid = cmd->nsid - 1; // 0-based
-	bool is_paddr_memremap = false;
+	struct prp_iter iter;
 
 	offset = __cmd_io_offset(cmd);
-	length = __cmd_io_size(cmd);
-	remaining = length;
+	__prp_iter_init(&iter, cmd);
 
-	while (remaining) {
+	for (;;) {
 		size_t io_size;
 		void *vaddr;
-		size_t mem_offs = 0;
+		size_t mem_offs;
 		bool is_vaddr_memremap = false;
+		unsigned int status;
 
-		prp_offs++;
-		if (prp_offs == 1) {
-			paddr = cmd->prp1;
-		} else if (prp_offs == 2) {
-			paddr = cmd->prp2;
-			if (remaining > PAGE_SIZE) {
-				if (pfn_valid(paddr >> PAGE_SHIFT)) {
-					paddr_list = kmap_atomic_pfn(PRP_PFN(paddr)) +
-						(paddr & PAGE_OFFSET_MASK);
-				} else {
-					paddr_list = memremap(paddr, PAGE_SIZE, MEMREMAP_WT);
-					paddr_list += (paddr & PAGE_OFFSET_MASK);
-					is_paddr_memremap = true;
-				}
-				paddr = paddr_list[prp2_offs++];
-			}
-		} else {
-			paddr = paddr_list[prp2_offs++];
-		}
+		status = __prp_iter_next(&iter, cache, &paddr, &io_size);
+		if (status != NVME_SC_SUCCESS)
+			return status;
+		if (io_size == 0)
+			break;
 
 		if (pfn_valid(paddr >> PAGE_SHIFT)) {
 			vaddr = kmap_atomic_pfn(PRP_PFN(paddr));
 		} else {
-			vaddr = memremap(paddr, PAGE_SIZE, MEMREMAP_WT);
+			vaddr = nvmev_remap(cache, paddr & PAGE_MASK);
 			is_vaddr_memremap = true;
 		}
 
-		io_size = min_t(size_t, remaining, PAGE_SIZE);
-
-		if (paddr & PAGE_OFFSET_MASK) {
-			mem_offs = paddr & PAGE_OFFSET_MASK;
-			if (io_size + mem_offs > PAGE_SIZE)
-				io_size = PAGE_SIZE - mem_offs;
-		}
+		mem_offs = paddr & PAGE_OFFSET_MASK;
 
-		if (cmd->opcode == nvme_cmd_write ||
-		    cmd->opcode == nvme_cmd_zone_append) {
-			memcpy(nvmev_vdev->ns[nsid].mapped + offset, vaddr + mem_offs, io_size);
-		} else if (cmd->opcode == nvme_cmd_read) {
-			memcpy(vaddr + mem_offs, nvmev_vdev->ns[nsid].mapped + offset, io_size);
-		}
+		if (vaddr != NULL)
+			__copy_run(cmd, nvmev_vdev->ns[nsid].mapped + offset, vaddr + mem_offs, io_size);
 
 		if (vaddr != NULL && !is_vaddr_memremap) {
 			kunmap_atomic(vaddr);
 			vaddr = NULL;
-		} else if (vaddr != NULL && is_vaddr_memremap) {
-			memunmap(vaddr);
-			vaddr = NULL;
-			is_vaddr_memremap = false;
 		}
 
-		remaining -= io_size;
 		offset += io_size;
 	}
 
-	if (paddr_list) {
-		if (!is_paddr_memremap) 
-			kunmap_atomic(paddr_list);
-		else if (is_paddr_memremap) 
-			memunmap(paddr_list);
-	}
-	paddr_list = NULL;
-
-	return length;
+	return NVME_SC_SUCCESS;
 }
 
-static u64 paddr_list[513] = {
-	0,
-}; // Not using index 0 to make max index == num_prp
-static unsigned int __do_perform_io_using_dma(int sqid, int sq_entry)
+/* Copy [@paddr, @paddr + @len) of the host, physically contiguous */
+static void __copy_host_range(struct nvme_rw_command *cmd, void *storage, u64 paddr, size_t len,
+			      struct nvmev_remap_cache *cache)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	struct nvme_rw_command *cmd = &sq_entry(sq_entry).rw;
-	size_t offset;
-	size_t length, remaining;
-	int prp_offs = 0;
-	int prp2_offs = 0;
-	int num_prps = 0;
-	u64 paddr;
-	u64 *tmp_paddr_list = NULL;
-	size_t io_size;
-	size_t mem_offs = 0;
-	bool is_memremap = false;
+	while (len) {
+		size_t run = 0;
 
-	offset = __cmd_io_offset(cmd);
-	length = __cmd_io_size(cmd);
-	remaining = length;
+		/* The longest part in the direct map goes at once */
+		while (run < len && pfn_valid(PRP_PFN(paddr + run)) &&
+		       (run == 0 || !IS_ENABLED(CONFIG_HIGHMEM)))
+			run += min_t(size_t, len - run, PAGE_SIZE - ((paddr + run) & PAGE_OFFSET_MASK));
 
-	memset(paddr_list, 0, sizeof(paddr_list));
-	/* Loop to get the PRP list */
-	while (remaining) {
-		io_size = 0;
-
-		prp_offs++;
-		if (prp_offs == 1) {
-			paddr_list[prp_offs] = cmd->prp1;
-		} else if (prp_offs == 2) {
-			paddr_list[prp_offs] = cmd->prp2;
-			if (remaining > PAGE_SIZE) {
-				if (pfn_valid(paddr_list[prp_offs] >> PAGE_SHIFT)) {
- 					tmp_paddr_list = kmap_atomic_pfn(PRP_PFN(paddr_list[prp_offs])) + 
-							(paddr_list[prp_offs] & PAGE_OFFSET_MASK);
- 				} else {
- 					tmp_paddr_list = memremap(paddr_list[prp_offs], PAGE_SIZE, MEMREMAP_WT);
- 					tmp_paddr_list += (paddr_list[prp_offs] & PAGE_OFFSET_MASK);
- 					is_memremap = true;
- 				}
-				paddr_list[prp_offs] = tmp_paddr_list[prp2_offs++];
-			}
+		if (run && IS_ENABLED(CONFIG_HIGHMEM)) {
+			void *vaddr = kmap_atomic_pfn(PRP_PFN(paddr));
+
+			__copy_run(cmd, storage, vaddr + (paddr & PAGE_OFFSET_MASK), run);
+			kunmap_atomic(vaddr);
+		} else if (run) {
+			__copy_run(cmd, storage, phys_to_virt(paddr), run);
 		} else {
-			paddr_list[prp_offs] = tmp_paddr_list[prp2_offs++];
+			void *vaddr = nvmev_remap(cache, paddr);
+
+			run = min_t(size_t, len, PAGE_SIZE - (paddr & PAGE_OFFSET_MASK));
+			if (vaddr)
+				__copy_run(cmd, storage, vaddr, run);
 		}
 
-		io_size = min_t(size_t, remaining, PAGE_SIZE);
+		storage += run;
+		paddr += run;
+		len -= run;
+	}
+}
 
-		if (paddr_list[prp_offs] & PAGE_OFFSET_MASK) {
-			mem_offs = paddr_list[prp_offs] & PAGE_OFFSET_MASK;
-			if (io_size + mem_offs > PAGE_SIZE)
-				io_size = PAGE_SIZE - mem_offs;
+/*
+ * Same as __do_perform_io_range() for the commands whose data pointer is an
+ * SGL. Each data block is physically contiguous, so it takes a single memcpy
+ * unless it leaves the direct map. Returns an NVMe status code.
+ */
+static unsigned int __do_perform_io_sgl(struct nvme_rw_command *cmd,
+					struct nvmev_remap_cache *cache, size_t from, size_t to)
+{
+	void *storage = nvmev_vdev->ns[cmd->nsid - 1].mapped + __cmd_io_offset(cmd) + from;
+	size_t pos = 0;
+	struct sgl_iter iter;
+
+	/* Only the commands moving data have their data pointer walked */
+	if (cmd->opcode != nvme_cmd_write && cmd->opcode != nvme_cmd_read &&
+	    cmd->opcode != nvme_cmd_zone_append)
+		return NVME_SC_SUCCESS;
+
+	sgl_iter_init(&iter, nvmev_cmd_sgl(cmd), cache);
+
+	while (pos < to) {
+		unsigned int status;
+		u64 paddr;
+		u32 len;
+
+		status = sgl_iter_next(&iter, &paddr, &len);
+		if (status != NVME_SC_SUCCESS)
+			return status;
+		if (len == 0)
+			return NVME_SC_SGL_INVALID_DATA;
+
+		/* Clip the block to [from, to) */
+		if (pos + len <= from) {
+			pos += len;
+			continue;
 		}
+		if (pos < from) {
+			paddr += from - pos;
+			len -= from - pos;
+			pos = from;
+		}
+		len = min_t(size_t, len, to - pos);
+
+		__copy_host_range(cmd, storage, paddr, len, cache);
 
-		remaining -= io_size;
+		storage += len;
+		pos += len;
 	}
-	num_prps = prp_offs;
 
-	if (tmp_paddr_list != NULL && !is_memremap) {
- 		kunmap_atomic(tmp_paddr_list);
- 	} else if (tmp_paddr_list != NULL && is_memremap) {
- 		memunmap(tmp_paddr_list);
- 		is_memremap = false;
- 	}
+	return NVME_SC_SUCCESS;
+}
 
-	remaining = length;
-	prp_offs = 1;
+/*
+ * Walk the PRPs from @from and copy each run of physically contiguous host
+ * pages in [@from, @to) of the command with a single memcpy through the
+ * direct map. Pages outside of it (e.g., device memory of a peer) are copied one
+ * by one through @cache. Returns an NVMe status code.
+ */
+static unsigned int __do_perform_io_range(struct nvme_rw_command *cmd,
+					  struct nvmev_remap_cache *cache, size_t from, size_t to)
+{
+	void *storage = nvmev_vdev->ns[cmd->nsid - 1].mapped + __cmd_io_offset(cmd) + from;
+	size_t pos = 0;
+	size_t run_len = 0;
+	u64 run_paddr = 0;
+	struct prp_iter iter;
+
+	if (nvmev_cmd_uses_sgl(cmd))
+		return __do_perform_io_sgl(cmd, cache, from, to);
+
+	__prp_iter_init(&iter, cmd);
+	if (from) {
+		unsigned int status = __prp_iter_seek(&iter, cache, from);
+
+		if (status != NVME_SC_SUCCESS)
+			return status;
+		pos = __cmd_io_size(cmd) - iter.remaining;
+	}
 
-	/* Loop for data transfer */
-	while (remaining) {
-		size_t page_size;
-		mem_offs = 0;
-		io_size = 0;
-		page_size = 0;
-
-		paddr = paddr_list[prp_offs];
-		page_size = min_t(size_t, remaining, PAGE_SIZE);
-
-		/* For non-page aligned paddr, it will never be between continuous PRP list (Always first paddr)  */
-		if (paddr & PAGE_OFFSET_MASK) {
-			mem_offs = paddr & PAGE_OFFSET_MASK;
-			if (page_size + mem_offs > PAGE_SIZE) {
-				page_size = PAGE_SIZE - mem_offs;
-			}
+	while (pos < to) {
+		unsigned int status;
+		u64 paddr;
+		size_t len;
+
+		status = __prp_iter_next(&iter, cache, &paddr, &len);
+		if (status != NVME_SC_SUCCESS)
+			return status;
+
+		/* Clip the page to [from, to) */
+		if (pos + len <= from) {
+			pos += len;
+			continue;
 		}
+		if (pos < from) {
+			paddr += from - pos;
+			len -= from - pos;
+			pos = from;
+		}
+		len = min_t(size_t, len, to - pos);
+		pos += len;
 
-		for (prp_offs++; prp_offs <= num_prps; prp_offs++) {
-			if (paddr_list[prp_offs] == paddr_list[prp_offs - 1] + PAGE_SIZE)
-				page_size += PAGE_SIZE;
-			else
-				break;
+		if (run_len && run_paddr + run_len == paddr && pfn_valid(PRP_PFN(paddr))) {
+			run_len += len;
+		} else {
+			if (run_len) {
+				__copy_run(cmd, storage, phys_to_virt(run_paddr), run_len);
+				storage += run_len;
+				run_len = 0;
+			}
+
+			if (pfn_valid(PRP_PFN(paddr))) {
+				run_paddr = paddr;
+				run_len = len;
+			} else {
+				void *vaddr = nvmev_remap(cache, paddr);
+
+				if (vaddr)
+					__copy_run(cmd, storage, vaddr, len);
+				storage += len;
+			}
 		}
+	}
+
+	if (run_len)
+		__copy_run(cmd, storage, phys_to_virt(run_paddr), run_len);
+
+	return NVME_SC_SUCCESS;
+}
+
+static unsigned int __do_perform_io(struct nvme_rw_command *cmd, struct nvmev_remap_cache *cache)
+{
+	if (IS_ENABLED(CONFIG_HIGHMEM) && !nvmev_cmd_uses_sgl(cmd))
+		return __do_perform_io_by_page(cmd, cache);
+
+	return __do_perform_io_range(cmd, cache, 0, __cmd_io_size(cmd));
+}
 
-		io_size = min_t(size_t, remaining, page_size);
+/*
+ * Called on each piece of the data of @cmd within a host page, mapped at
+ * @vaddr and @pos bytes into the data. Returns an NVMe status code.
+ */
+typedef unsigned int (*host_page_fn)(struct nvme_rw_command *cmd, void *vaddr, size_t pos,
+				     size_t len);
+
+/* Call @fn on [@paddr, @paddr + @len) of the host a page at a time */
+static unsigned int __for_each_host_page(struct nvme_rw_command *cmd, u64 paddr, size_t len,
+					 size_t pos, struct nvmev_remap_cache *cache,
+					 host_page_fn fn)
+{
+	while (len) {
+		size_t run = min_t(size_t, len, PAGE_SIZE - (paddr & PAGE_OFFSET_MASK));
+		unsigned int status;
+		void *vaddr;
 
-		if (cmd->opcode == nvme_cmd_write ||
-		    cmd->opcode == nvme_cmd_zone_append) {
-			ioat_dma_submit(paddr, nvmev_vdev->config.storage_start + offset, io_size);
-		} else if (cmd->opcode == nvme_cmd_read) {
-			ioat_dma_submit(nvmev_vdev->config.storage_start + offset, paddr, io_size);
+		if (pfn_valid(PRP_PFN(paddr))) {
+			vaddr = kmap_local_pfn(PRP_PFN(paddr));
+			status = fn(cmd, vaddr + (paddr & PAGE_OFFSET_MASK), pos, run);
+			kunmap_local(vaddr);
+		} else {
+			vaddr = nvmev_remap(cache, paddr);
+			if (!vaddr)
+				return NVME_SC_DATA_XFER_ERROR;
+			status = fn(cmd, vaddr, pos, run);
 		}
 
-		remaining -= io_size;
-		offset += io_size;
+		if (status != NVME_SC_SUCCESS)
+			return status;
+
+		paddr += run;
+		pos += run;
+		len -= run;
 	}
 
-	return length;
+	return NVME_SC_SUCCESS;
 }
 
-static void __insert_req_sorted(unsigned int entry, struct nvmev_io_worker *worker,
-				unsigned long nsecs_target)
+/* Walk the data pointer of @cmd and call @fn on the data a host page at a time */
+static unsigned int __walk_host_pages(struct nvme_rw_command *cmd,
+				      struct nvmev_remap_cache *cache, host_page_fn fn)
 {
-	/**
-	 * Requests are placed in @work_queue sorted by their target time.
-	 * @work_queue is statically allocated and the ordered list is
-	 * implemented by chaining the indexes of entries with @prev and @next.
-	 * This implementation is nasty but we do this way over dynamically
-	 * allocated linked list to minimize the influence of dynamic memory allocation.
-	 * Also, this O(n) implementation can be improved to O(logn) scheme with
-	 * e.g., red-black tree but....
-	 */
-	if (worker->io_seq == -1) {
-		worker->io_seq = entry;
-		worker->io_seq_end = entry;
+	size_t remaining = __cmd_io_size(cmd);
+	size_t pos = 0;
+	unsigned int status;
+	u64 paddr;
+
+	if (nvmev_cmd_uses_sgl(cmd)) {
+		struct sgl_iter iter;
+		u32 len;
+
+		sgl_iter_init(&iter, nvmev_cmd_sgl(cmd), cache);
+
+		while (remaining) {
+			status = sgl_iter_next(&iter, &paddr, &len);
+			if (status != NVME_SC_SUCCESS)
+				return status;
+			if (len == 0)
+				return NVME_SC_SGL_INVALID_DATA;
+
+			len = min_t(size_t, len, remaining);
+			status = __for_each_host_page(cmd, paddr, len, pos, cache, fn);
+			if (status != NVME_SC_SUCCESS)
+				return status;
+
+			pos += len;
+			remaining -= len;
+		}
 	} else {
-		unsigned int curr = worker->io_seq_end;
+		struct prp_iter iter;
+		size_t len;
 
-		while (curr != -1) {
-			if (worker->work_queue[curr].nsecs_target <= worker->latest_nsecs)
-				break;
+		__prp_iter_init(&iter, cmd);
 
-			if (worker->work_queue[curr].nsecs_target <= nsecs_target)
+		for (;;) {
+			status = __prp_iter_next(&iter, cache, &paddr, &len);
+			if (status != NVME_SC_SUCCESS)
+				return status;
+			if (len == 0)
 				break;
 
-			curr = worker->work_queue[curr].prev;
-		}
+			status = __for_each_host_page(cmd, paddr, len, pos, cache, fn);
+			if (status != NVME_SC_SUCCESS)
+				return status;
 
-		if (curr == -1) { /* Head inserted */
-			worker->work_queue[worker->io_seq].prev = entry;
-			worker->work_queue[entry].next = worker->io_seq;
-			worker->io_seq = entry;
-		} else if (worker->work_queue[curr].next == -1) { /* Tail */
-			worker->work_queue[entry].prev = curr;
-			worker->io_seq_end = entry;
-			worker->work_queue[curr].next = entry;
-		} else { /* In between */
-			worker->work_queue[entry].prev = curr;
-			worker->work_queue[entry].next = worker->work_queue[curr].next;
-
-			worker->work_queue[worker->work_queue[entry].next].prev = entry;
-			worker->work_queue[curr].next = entry;
+			pos += len;
 		}
 	}
+
+	return NVME_SC_SUCCESS;
 }
 
-static struct nvmev_io_worker *__allocate_work_queue_entry(int sqid, unsigned int *entry)
+static unsigned int __zero_host_page(struct nvme_rw_command *cmd, void *vaddr, size_t pos,
+				     size_t len)
 {
-	unsigned int io_worker_turn = __get_io_worker(sqid);
-	struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[io_worker_turn];
-	unsigned int e = worker->free_seq;
-	struct nvmev_io_work *w = worker->work_queue + e;
+	memset(vaddr, 0, len);
+	return NVME_SC_SUCCESS;
+}
 
-	if (w->next >= NR_MAX_PARALLEL_IO) {
-		WARN_ON_ONCE("IO queue is almost full");
-		return NULL;
-	}
+/*
+ * Nothing is kept for a timing-only namespace; writes are dropped, and reads
+ * return zeros. Returns an NVMe status code.
+ */
+static unsigned int __do_perform_io_timing_only(struct nvme_rw_command *cmd,
+						struct nvmev_remap_cache *cache)
+{
+	if (cmd->opcode != nvme_cmd_read)
+		return NVME_SC_SUCCESS;
 
-	if (++io_worker_turn == nvmev_vdev->config.nr_io_workers)
-		io_worker_turn = 0;
-	nvmev_vdev->io_worker_turn = io_worker_turn;
+	return __walk_host_pages(cmd, cache, __zero_host_page);
+}
 
-	worker->free_seq = w->next;
-	BUG_ON(worker->free_seq >= NR_MAX_PARALLEL_IO);
-	*entry = e;
+static unsigned int __thin_host_page(struct nvme_rw_command *cmd, void *vaddr, size_t pos,
+				     size_t len)
+{
+	struct nvmev_thin *thin = nvmev_vdev->ns[cmd->nsid - 1].thin;
+	u64 offset = __cmd_io_offset(cmd) + pos;
 
-	return worker;
+	/* A piece of a host page may span two pages of the namespace */
+	while (len) {
+		size_t run = min_t(size_t, len, PAGE_SIZE - (offset & PAGE_OFFSET_MASK));
+		unsigned int status;
+
+		if (cmd->opcode == nvme_cmd_read)
+			status = thin_read(thin, offset, vaddr, run);
+		else
+			status = thin_write(thin, offset, vaddr, run);
+
+		if (status != NVME_SC_SUCCESS)
+			return status;
+
+		vaddr += run;
+		offset += run;
+		len -= run;
+	}
+
+	return NVME_SC_SUCCESS;
 }
 
-static void __enqueue_io_req(int sqid, int cqid, int sq_entry, unsigned long long nsecs_start,
-			     struct nvmev_result *ret)
+/*
+ * The data of a thin-provisioned namespace goes through its page table, so
+ * that pages filled with a single byte take no memory. Returns an NVMe
+ * status code.
+ */
+static unsigned int __do_perform_io_thin(struct nvme_rw_command *cmd,
+					 struct nvmev_remap_cache *cache)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	struct nvmev_io_worker *worker;
-	struct nvmev_io_work *w;
-	unsigned int entry;
+	return __walk_host_pages(cmd, cache, __thin_host_page);
+}
 
-	worker = __allocate_work_queue_entry(sqid, &entry);
-	if (!worker)
-		return;
+/* Namespace of the data of @w, or NULL for a command not moving data */
+static inline struct nvmev_ns *__data_ns(struct nvmev_io_work *w)
+{
+	u32 nsid = w->cmd.rw.nsid;
+
+	if (w->cmd.common.opcode != nvme_cmd_write && w->cmd.common.opcode != nvme_cmd_read &&
+	    w->cmd.common.opcode != nvme_cmd_zone_append)
+		return NULL;
 
-	w = worker->work_queue + entry;
+	if (nsid < 1 || nsid > nvmev_vdev->nr_ns)
+		return NULL;
 
-	NVMEV_DEBUG_VERBOSE("%s/%u[%d], sq %d cq %d, entry %d, %llu + %llu\n", worker->thread_name, entry,
-		    sq_entry(sq_entry).rw.opcode, sqid, cqid, sq_entry, nsecs_start,
-		    ret->nsecs_target - nsecs_start);
+	return &nvmev_vdev->ns[nsid - 1];
+}
 
-	/////////////////////////////////
-	w->sqid = sqid;
-	w->cqid = cqid;
-	w->sq_entry = sq_entry;
-	w->command_id = sq_entry(sq_entry).common.command_id;
-	w->nsecs_start = nsecs_start;
-	w->nsecs_enqueue = local_clock();
-	w->nsecs_target = ret->nsecs_target;
-	w->status = ret->status;
-	w->result0 = (unsigned int)(ret->result & 0xFFFFFFFF);
-	w->result1 = (unsigned int)(ret->result >> 32);
-	w->is_completed = false;
-	w->is_copied = false;
-	w->prev = -1;
-	w->next = -1;
+/*
+ * Copy throughput of a single thread, triggered by writing
+ * "copy_bench [size_kb]" to /proc/nvmev/debug. Reads @size_kb from the
+ * start of the first namespace into a physically contiguous buffer, a page
+ * at a time and with contiguous runs coalesced.
+ */
+#define COPY_BENCH_NSECS (500 * NSEC_PER_MSEC)
+
+static unsigned long long __copy_bench_one(unsigned int (*copy)(struct nvme_rw_command *,
+								 struct nvmev_remap_cache *),
+					   struct nvme_rw_command *cmd, struct nvmev_remap_cache *cache)
+{
+	unsigned long long start = local_clock(), elapsed;
+	unsigned long long bytes = 0;
 
-	w->is_internal = false;
-	mb(); /* IO worker shall see the updated w at once */
+	do {
+		copy(cmd, cache);
+		bytes += __cmd_io_size(cmd);
+		cond_resched();
+		elapsed = local_clock() - start;
+	} while (elapsed < COPY_BENCH_NSECS);
 
-	__insert_req_sorted(entry, worker, ret->nsecs_target);
+	return div64_u64(bytes * 1000, elapsed); /* MB/s */
 }
 
-void schedule_internal_operation(int sqid, unsigned long long nsecs_target,
-				 struct buffer *write_buffer, size_t buffs_to_release)
+void nvmev_copy_bench(unsigned int size_kb)
 {
-	struct nvmev_io_worker *worker;
-	struct nvmev_io_work *w;
-	unsigned int entry;
+	size_t size = (size_t)size_kb << 10;
+	unsigned int nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	struct nvme_rw_command cmd = {
+		.opcode = nvme_cmd_read,
+		.nsid = 1,
+		.slba = 0,
+	};
+	struct page *buf = NULL, *list = NULL;
+	struct nvmev_remap_cache *cache;
+	unsigned long long by_page, coalesced;
+	u64 *prps;
+	unsigned int i;
 
-	worker = __allocate_work_queue_entry(sqid, &entry);
-	if (!worker)
+	/* A single PRP list page */
+	if (size == 0 || nr_pages > PAGE_SIZE / sizeof(u64) + 1 ||
+	    size > nvmev_vdev->ns[0].size || !nvmev_vdev->ns[0].mapped) {
+		NVMEV_ERROR("copy_bench: invalid size %u KiB\n", size_kb);
 		return;
+	}
 
-	w = worker->work_queue + entry;
+	buf = alloc_pages(GFP_KERNEL, get_order(size));
+	list = alloc_page(GFP_KERNEL);
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!buf || !list || !cache) {
+		NVMEV_ERROR("copy_bench: cannot allocate %u KiB\n", size_kb);
+		goto out;
+	}
 
-	NVMEV_DEBUG_VERBOSE("%s/%u, internal sq %d, %llu + %llu\n", worker->thread_name, entry, sqid,
-		    local_clock(), nsecs_target - local_clock());
+	prps = page_address(list);
+	for (i = 1; i < nr_pages; i++)
+		prps[i - 1] = page_to_phys(buf) + i * PAGE_SIZE;
 
-	/////////////////////////////////
-	w->sqid = sqid;
-	w->nsecs_start = w->nsecs_enqueue = local_clock();
-	w->nsecs_target = nsecs_target;
-	w->is_completed = false;
-	w->is_copied = true;
-	w->prev = -1;
-	w->next = -1;
+	cmd.length = (size >> LBA_BITS) - 1;
+	cmd.prp1 = page_to_phys(buf);
+	cmd.prp2 = nr_pages == 2 ? prps[0] : page_to_phys(list);
 
-	w->is_internal = true;
-	w->write_buffer = write_buffer;
-	w->buffs_to_release = buffs_to_release;
-	mb(); /* IO worker shall see the updated w at once */
+	by_page = __copy_bench_one(__do_perform_io_by_page, &cmd, cache);
+	coalesced = __copy_bench_one(__do_perform_io, &cmd, cache);
 
-	__insert_req_sorted(entry, worker, nsecs_target);
+	NVMEV_INFO("copy_bench %u KiB: by page %llu MB/s, coalesced %llu MB/s\n", size_kb, by_page,
+		   coalesced);
+out:
+	if (cache) {
+		__remap_cache_release(cache);
+		kfree(cache);
+	}
+	if (list)
+		__free_page(list);
+	if (buf)
+		__free_pages(buf, get_order(size));
 }
 
-static void __reclaim_completed_reqs(void)
+/*
+ * Queue the DMA of [@paddr, @paddr + @len) of the host from or to @storage.
+ * The CPU copies the part the channels cannot take instead.
+ */
+static void __dma_range(struct nvme_rw_command *cmd, struct ioat_dma_batch *batch, void *storage,
+			u64 paddr, size_t len, struct nvmev_remap_cache *cache)
 {
-	unsigned int turn;
-
-	for (turn = 0; turn < nvmev_vdev->config.nr_io_workers; turn++) {
-		struct nvmev_io_worker *worker;
-		struct nvmev_io_work *w;
+	dma_addr_t storage_addr =
+		nvmev_vdev->config.storage_start + (storage - nvmev_vdev->storage_mapped);
+	size_t queued;
+
+	if (cmd->opcode == nvme_cmd_write || cmd->opcode == nvme_cmd_zone_append)
+		queued = ioat_dma_batch_add(batch, paddr, storage_addr, len);
+	else if (cmd->opcode == nvme_cmd_read)
+		queued = ioat_dma_batch_add(batch, storage_addr, paddr, len);
+	else
+		return;
 
-		unsigned int first_entry = -1;
-		unsigned int last_entry = -1;
-		unsigned int curr;
-		int nr_reclaimed = 0;
+	if (queued < len)
+		__copy_host_range(cmd, storage + queued, paddr + queued, len - queued, cache);
+}
 
-		worker = &nvmev_vdev->io_workers[turn];
+/* Data blocks of an SGL are physically contiguous and go in a transfer each */
+static unsigned int __do_perform_io_sgl_using_dma(struct nvme_rw_command *cmd,
+						  struct ioat_dma_batch *batch,
+						  struct nvmev_remap_cache *cache)
+{
+	void *storage = nvmev_vdev->ns[cmd->nsid - 1].mapped + __cmd_io_offset(cmd);
+	size_t remaining = __cmd_io_size(cmd);
+	struct sgl_iter iter;
 
-		first_entry = worker->io_seq;
-		curr = first_entry;
+	/* Only the commands moving data have their data pointer walked */
+	if (cmd->opcode != nvme_cmd_write && cmd->opcode != nvme_cmd_read &&
+	    cmd->opcode != nvme_cmd_zone_append)
+		return NVME_SC_SUCCESS;
 
-		while (curr != -1) {
-			w = &worker->work_queue[curr];
-			if (w->is_completed == true && w->is_copied == true &&
-			    w->nsecs_target <= worker->latest_nsecs) {
-				last_entry = curr;
-				curr = w->next;
-				nr_reclaimed++;
-			} else {
-				break;
-			}
-		}
+	sgl_iter_init(&iter, nvmev_cmd_sgl(cmd), cache);
 
-		if (last_entry != -1) {
-			w = &worker->work_queue[last_entry];
-			worker->io_seq = w->next;
-			if (w->next != -1) {
-				worker->work_queue[w->next].prev = -1;
-			}
-			w->next = -1;
+	while (remaining) {
+		unsigned int status;
+		u64 paddr;
+		u32 len;
 
-			w = &worker->work_queue[first_entry];
-			w->prev = worker->free_seq_end;
+		status = sgl_iter_next(&iter, &paddr, &len);
+		if (status != NVME_SC_SUCCESS)
+			return status;
+		if (len == 0)
+			return NVME_SC_SGL_INVALID_DATA;
 
-			w = &worker->work_queue[worker->free_seq_end];
-			w->next = first_entry;
+		len = min_t(size_t, len, remaining);
+		__dma_range(cmd, batch, storage, paddr, len, cache);
 
-			worker->free_seq_end = last_entry;
-			NVMEV_DEBUG_VERBOSE("%s: %u -- %u, %d\n", __func__,
-					first_entry, last_entry, nr_reclaimed);
-		}
+		storage += len;
+		remaining -= len;
 	}
+
+	return NVME_SC_SUCCESS;
 }
 
-static size_t __nvmev_proc_io(int sqid, int sq_entry, size_t *io_size)
+/*
+ * Queue the transfers of the command to @batch, a run of physically
+ * contiguous host pages at a time. They are issued at once by the caller,
+ * and the copy completes in the callback of the batch. Returns an NVMe
+ * status code.
+ */
+static unsigned int __do_perform_io_using_dma(struct nvme_rw_command *cmd,
+					      struct ioat_dma_batch *batch,
+					      struct nvmev_remap_cache *cache)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	unsigned long long nsecs_start = __get_wallclock();
-	struct nvme_command *cmd = &sq_entry(sq_entry);
-#if (BASE_SSD == KV_PROTOTYPE)
-	uint32_t nsid = 0; // Some KVSSD programs give 0 as nsid for KV IO
-#else
-	uint32_t nsid = cmd->common.nsid - 1;
-#endif
-	struct nvmev_ns *ns = &nvmev_vdev->ns[nsid];
+	void *storage = nvmev_vdev->ns[cmd->nsid - 1].mapped + __cmd_io_offset(cmd);
+	size_t run_len = 0;
+	u64 run_paddr = 0;
+	struct prp_iter iter;
 
-	struct nvmev_request req = {
-		.cmd = cmd,
-		.sq_id = sqid,
-		.nsecs_start = nsecs_start,
-	};
-	struct nvmev_result ret = {
-		.nsecs_target = nsecs_start,
-		.status = NVME_SC_SUCCESS,
-	};
+	if (nvmev_cmd_uses_sgl(cmd))
+		return __do_perform_io_sgl_using_dma(cmd, batch, cache);
 
-#ifdef PERF_DEBUG
-	unsigned long long prev_clock = local_clock();
-	unsigned long long prev_clock2 = 0;
-	unsigned long long prev_clock3 = 0;
-	unsigned long long prev_clock4 = 0;
-	static unsigned long long clock1 = 0;
-	static unsigned long long clock2 = 0;
-	static unsigned long long clock3 = 0;
-	static unsigned long long counter = 0;
-#endif
+	__prp_iter_init(&iter, cmd);
 
-	if (!ns->proc_io_cmd(ns, &req, &ret))
-		return false;
-	*io_size = __cmd_io_size(&sq_entry(sq_entry).rw);
+	for (;;) {
+		unsigned int status;
+		u64 paddr;
+		size_t len;
 
-#ifdef PERF_DEBUG
-	prev_clock2 = local_clock();
-#endif
+		status = __prp_iter_next(&iter, cache, &paddr, &len);
+		if (status != NVME_SC_SUCCESS)
+			return status;
+		if (len == 0)
+			break;
 
-	__enqueue_io_req(sqid, sq->cqid, sq_entry, nsecs_start, &ret);
+		if (run_len && run_paddr + run_len == paddr) {
+			run_len += len;
+		} else {
+			if (run_len) {
+				__dma_range(cmd, batch, storage, run_paddr, run_len, cache);
+				storage += run_len;
+			}
+			run_paddr = paddr;
+			run_len = len;
+		}
+	}
 
-#ifdef PERF_DEBUG
-	prev_clock3 = local_clock();
-#endif
+	if (run_len)
+		__dma_range(cmd, batch, storage, run_paddr, run_len, cache);
 
-	__reclaim_completed_reqs();
+	return NVME_SC_SUCCESS;
+}
 
-#ifdef PERF_DEBUG
-	prev_clock4 = local_clock();
+static inline void __ring_push(struct nvmev_io_ring *ring, unsigned int entry)
+{
+	ring->entries[ring->next_tail++ & ring->mask] = entry;
+}
 
-	clock1 += (prev_clock2 - prev_clock);
-	clock2 += (prev_clock3 - prev_clock2);
-	clock3 += (prev_clock4 - prev_clock3);
-	counter++;
+static inline void __ring_publish(struct nvmev_io_ring *ring)
+{
+	smp_store_release(&ring->tail, ring->next_tail);
+}
 
-	if (counter > 1000) {
-		NVMEV_DEBUG("LAT: %llu, ENQ: %llu, CLN: %llu\n", clock1 / counter, clock2 / counter,
-			    clock3 / counter);
-		clock1 = 0;
-		clock2 = 0;
-		clock3 = 0;
-		counter = 0;
+static inline unsigned int __ring_pop(struct nvmev_io_ring *ring)
+{
+	if (ring->head == ring->cached_tail) {
+		ring->cached_tail = smp_load_acquire(&ring->tail);
+		if (ring->head == ring->cached_tail)
+			return -1;
 	}
-#endif
-	return true;
+	return ring->entries[ring->head++ & ring->mask];
 }
 
-int nvmev_proc_io_sq(int sqid, int new_db, int old_db)
+static int __ring_init(struct nvmev_io_ring *ring, unsigned int size, int node)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	int num_proc = new_db - old_db;
-	int seq;
-	int sq_entry = old_db;
-	int latest_db;
+	BUG_ON(!is_power_of_2(size));
 
-	if (unlikely(!sq))
-		return old_db;
-	if (unlikely(num_proc < 0))
-		num_proc += sq->queue_size;
+	ring->entries = kvzalloc_node(array_size(size, sizeof(*ring->entries)), GFP_KERNEL, node);
+	if (!ring->entries)
+		return -ENOMEM;
 
-	for (seq = 0; seq < num_proc; seq++) {
-		size_t io_size;
-		if (!__nvmev_proc_io(sqid, sq_entry, &io_size))
-			break;
+	ring->mask = size - 1;
+	ring->tail = ring->next_tail = 0;
+	ring->head = ring->cached_tail = 0;
+	return 0;
+}
 
-		if (++sq_entry == sq->queue_size) {
-			sq_entry = 0;
-		}
-		sq->stat.nr_dispatched++;
-		sq->stat.nr_in_flight++;
-		sq->stat.total_io += io_size;
-	}
-	sq->stat.nr_dispatch++;
-	sq->stat.max_nr_in_flight = max_t(int, sq->stat.max_nr_in_flight, sq->stat.nr_in_flight);
+static void __ring_exit(struct nvmev_io_ring *ring)
+{
+	kvfree(ring->entries);
+}
 
-	latest_db = (old_db + seq) % sq->queue_size;
-	return latest_db;
+/* Wake up the worker sleeping while idle or for the completion timer on a new request */
+static inline void __kick_io_worker(struct nvmev_io_worker *worker)
+{
+	nvmev_idle_kick(&worker->idle, worker->task_struct);
 }
 
-void nvmev_proc_io_cq(int cqid, int new_db, int old_db)
+/*
+ * Only the worker owning a CQ signals its interrupt with IO_WORKER_BY_SQ. Wake
+ * it up when another worker posts to the CQ while it sleeps on an empty wheel.
+ */
+static inline void __kick_irq_owner(int cqid)
+{
+#ifdef CONFIG_NVMEV_IO_WORKER_BY_SQ
+	struct nvmev_io_worker *owner = &nvmev_vdev->io_workers[__get_io_worker(cqid)];
+
+	if (owner->task_struct != current)
+		__kick_io_worker(owner);
+#endif
+}
+
+static inline struct nvmev_io_work *__get_work(struct nvmev_io_worker *worker, unsigned int entry)
+{
+	return nvmev_get_work(worker->work_queue, entry);
+}
+
+/*
+ * Add a chunk of entries to the pool of @worker and keep them in @free_seq.
+ * Only the dispatcher owning @worker grows it, and the new entries reach the
+ * other threads through the rings, which orders the chunk pointer before them.
+ */
+static bool __grow_work_queue(struct nvmev_io_worker *worker, gfp_t gfp)
+{
+	struct nvmev_io_work *chunk;
+	unsigned int base = worker->nr_works;
+	int i;
+
+	if (base >= NR_MAX_PARALLEL_IO)
+		return false;
+
+	chunk = kcalloc_node(NR_WORKS_PER_CHUNK, sizeof(*chunk), gfp, worker->node);
+	if (!chunk)
+		return false;
+
+	for (i = NR_WORKS_PER_CHUNK - 1; i >= 0; i--) {
+		chunk[i].next = worker->free_seq;
+		worker->free_seq = base + i;
+	}
+
+	WRITE_ONCE(worker->work_queue[base >> NR_WORKS_PER_CHUNK_SHIFT], chunk);
+	worker->nr_works += NR_WORKS_PER_CHUNK;
+
+	return true;
+}
+
+/*
+ * Take a free entry of the IO worker for @sqid, growing the pool if all are
+ * in flight. Returns NULL when it cannot grow any more; the caller should
+ * hold the request back rather than dropping it.
+ */
+static struct nvmev_io_worker *__allocate_work_queue_entry(int sqid, unsigned int *entry, gfp_t gfp)
+{
+	struct nvmev_dispatcher *dispatcher = &nvmev_vdev->dispatchers[nvmev_get_dispatcher(sqid)];
+	struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[__get_io_worker(sqid)];
+	unsigned int e;
+
+	if (worker->free_seq == -1) {
+		e = __ring_pop(&worker->return_ring);
+		if (e != -1)
+			goto out;
+
+		if (!__grow_work_queue(worker, gfp))
+			return NULL;
+	}
+	e = worker->free_seq;
+	worker->free_seq = __get_work(worker, e)->next;
+
+out:
+	if (++dispatcher->io_worker_turn == __nr_io_workers_of(dispatcher->id))
+		dispatcher->io_worker_turn = 0;
+
+	*entry = e;
+
+	return worker;
+}
+
+void schedule_internal_operation(int sqid, unsigned long long nsecs_target,
+				 struct buffer *write_buffer, size_t buffs_to_release)
+{
+	struct nvmev_io_worker *worker;
+	struct nvmev_io_work *w;
+	unsigned int entry;
+
+	/* Called under the FTL lock */
+	worker = __allocate_work_queue_entry(sqid, &entry, GFP_ATOMIC | __GFP_NOWARN);
+	if (!worker) {
+		/* No room to time it; release the buffer at once rather than leaking it */
+#if (SUPPORTED_SSD_TYPE(CONV) || SUPPORTED_SSD_TYPE(ZNS))
+		buffer_release(write_buffer, buffs_to_release);
+#endif
+		return;
+	}
+
+	w = __get_work(worker, entry);
+
+	trace_nvmev_internal_op(sqid, nsecs_target, buffs_to_release);
+
+	/////////////////////////////////
+	w->sqid = sqid;
+	w->nsecs_start = w->nsecs_enqueue = local_clock();
+	w->nsecs_target = nsecs_target;
+	w->is_internal = true;
+	w->write_buffer = write_buffer;
+	w->buffs_to_release = buffs_to_release;
+
+	__ring_push(&worker->submit_ring, entry);
+	__ring_publish(&worker->submit_ring);
+	__kick_io_worker(worker);
+}
+
+static void __release_work_queue_entry(struct nvmev_io_worker *worker, unsigned int entry)
+{
+	/* Not submitted yet; keep it for the next allocation */
+	__get_work(worker, entry)->next = worker->free_seq;
+	worker->free_seq = entry;
+}
+
+static bool __nvmev_proc_io(struct nvmev_io_worker *worker, unsigned int entry,
+			    unsigned long long nsecs_start, size_t *io_size)
+{
+	struct nvmev_io_work *w = __get_work(worker, entry);
+#if (BASE_SSD == KV_PROTOTYPE)
+	uint32_t nsid = 0; // Some KVSSD programs give 0 as nsid for KV IO
+#else
+	uint32_t nsid = w->cmd.common.nsid - 1;
+#endif
+	struct nvmev_ns *ns = &nvmev_vdev->ns[nsid];
+
+	struct nvmev_request req = {
+		.cmd = &w->cmd,
+		.sq_id = w->sqid,
+		.nsecs_start = nsecs_start,
+	};
+	struct nvmev_result ret = {
+		.nsecs_target = nsecs_start,
+		.status = NVME_SC_SUCCESS,
+	};
+	unsigned long long nsecs_ftl = local_clock();
+
+	spin_lock(&ns->ftl_lock);
+	if (!ns->proc_io_cmd(ns, &req, &ret)) {
+		spin_unlock(&ns->ftl_lock);
+		return false;
+	}
+	spin_unlock(&ns->ftl_lock);
+	*io_size = __cmd_io_size(&w->cmd.rw);
+
+	w->nsecs_start = nsecs_start;
+	w->nsecs_enqueue = local_clock();
+	w->nsecs_ftl = w->nsecs_enqueue - nsecs_ftl;
+
+	trace_nvmev_ftl(w->sqid, &w->cmd, nsecs_start, ret.nsecs_target, ret.status, w->nsecs_ftl);
+
+	w->nsecs_target = ret.nsecs_target;
+	w->status = ret.status;
+	w->result0 = (unsigned int)(ret.result & 0xFFFFFFFF);
+	w->result1 = (unsigned int)(ret.result >> 32);
+	w->is_internal = false;
+
+	return true;
+}
+
+/*
+ * Process up to @nr_entries SQEs starting from @sq_entry as a batch:
+ * work queue entries are allocated and the SQEs are copied into them at
+ * once, the FTL runs over the copied commands, and the entries are handed
+ * to the IO workers with a single barrier. Returns the number of SQEs
+ * consumed; the rest are left in the SQ (e.g., when the write buffer or the
+ * work queue is full) and will be fetched again later.
+ */
+static int __nvmev_proc_io_batch(struct nvmev_dispatcher *dispatcher, int sqid, int sq_entry,
+				 int nr_entries)
+{
+	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
+	struct nvmev_io_worker *workers[NR_SQ_BATCH];
+	unsigned int entries[NR_SQ_BATCH];
+	unsigned long long nsecs_start, clock1, clock2, clock3;
+	int nr_fetched, nr_done;
+	int i;
+
+	nsecs_start = __get_wallclock();
+	clock1 = local_clock();
+
+	for (nr_fetched = 0; nr_fetched < nr_entries; nr_fetched++) {
+		struct nvmev_io_work *w;
+
+		/* Leave the rest in the SQ until some requests complete */
+		workers[nr_fetched] =
+			__allocate_work_queue_entry(sqid, &entries[nr_fetched], GFP_KERNEL);
+		if (!workers[nr_fetched])
+			break;
+
+		w = __get_work(workers[nr_fetched], entries[nr_fetched]);
+		memcpy(&w->cmd, &sq_entry(sq_entry), sizeof(w->cmd));
+		w->sqid = sqid;
+		w->cqid = sq->cqid;
+		w->sq_entry = sq_entry;
+		w->command_id = w->cmd.common.command_id;
+
+		trace_nvmev_sqe_fetch(sqid, sq_entry, &w->cmd);
+
+		if (++sq_entry == sq->queue_size)
+			sq_entry = 0;
+	}
+
+	clock2 = local_clock();
+
+	for (nr_done = 0; nr_done < nr_fetched; nr_done++) {
+		size_t io_size;
+
+		if (!__nvmev_proc_io(workers[nr_done], entries[nr_done], nsecs_start, &io_size))
+			break;
+
+		sq->stat.nr_dispatched++;
+		atomic_inc(&sq->stat.nr_in_flight);
+		sq->stat.total_io += io_size;
+	}
+
+	for (i = nr_fetched - 1; i >= nr_done; i--)
+		__release_work_queue_entry(workers[i], entries[i]);
+
+	clock3 = local_clock();
+
+	for (i = 0; i < nr_done; i++)
+		__ring_push(&workers[i]->submit_ring, entries[i]);
+	for (i = 0; i < nr_done; i++) {
+		__ring_publish(&workers[i]->submit_ring);
+		__kick_io_worker(workers[i]);
+	}
+
+	dispatcher->stat.nr_cmds += nr_done;
+	dispatcher->stat.nsecs_fetch += clock2 - clock1;
+	dispatcher->stat.nsecs_ftl += clock3 - clock2;
+	dispatcher->stat.nsecs_enqueue += local_clock() - clock3;
+
+	return nr_done;
+}
+
+int nvmev_proc_io_sq(int sqid, int new_db, int old_db)
+{
+	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
+	struct nvmev_dispatcher *dispatcher = &nvmev_vdev->dispatchers[nvmev_get_dispatcher(sqid)];
+	int num_proc = new_db - old_db;
+	int seq = 0;
+	int sq_entry = old_db;
+	int latest_db;
+
+	if (unlikely(!sq))
+		return old_db;
+	if (unlikely(num_proc < 0))
+		num_proc += sq->queue_size;
+
+	while (seq < num_proc) {
+		int nr_batch = min(num_proc - seq, NR_SQ_BATCH);
+		int nr_done = __nvmev_proc_io_batch(dispatcher, sqid, sq_entry, nr_batch);
+
+		seq += nr_done;
+		sq_entry = (sq_entry + nr_done) % sq->queue_size;
+		if (nr_done < nr_batch)
+			break;
+	}
+	sq->stat.nr_dispatch++;
+	sq->stat.max_nr_in_flight =
+		max_t(int, sq->stat.max_nr_in_flight, atomic_read(&sq->stat.nr_in_flight));
+
+	latest_db = (old_db + seq) % sq->queue_size;
+	return latest_db;
+}
+
+void nvmev_proc_io_cq(int cqid, int new_db, int old_db)
 {
 	struct nvmev_completion_queue *cq = nvmev_vdev->cqes[cqid];
 	int i;
@@ -549,20 +1185,23 @@ void nvmev_proc_io_cq(int cqid, int new_db, int old_db)
 			continue;
 		}
 		int sqid = cq_entry(i).sq_id;
+		struct nvmev_submission_queue *sq = READ_ONCE(nvmev_vdev->sqes[sqid]);
 
 		/* Should check the validity here since SPDK deletes SQ immediately
 		 * before processing associated CQes */
-		if (!nvmev_vdev->sqes[sqid]) continue;
+		if (!sq) continue;
 
-		nvmev_vdev->sqes[sqid]->stat.nr_in_flight--;
+		atomic_dec(&sq->stat.nr_in_flight);
 	}
 
-	cq->cq_tail = new_db - 1;
-	if (new_db == -1)
-		cq->cq_tail = cq->queue_size - 1;
+	WRITE_ONCE(cq->cq_tail, new_db - 1);
 }
 
-static void __fill_cq_result(struct nvmev_io_work *w)
+/*
+ * Post the completion of @w. Returns false, leaving the CQ untouched, if the
+ * CQ is full, i.e., the host has not consumed the entries posted so far.
+ */
+static bool __fill_cq_result(struct nvmev_io_work *w)
 {
 	int sqid = w->sqid;
 	int cqid = w->cqid;
@@ -572,12 +1211,23 @@ static void __fill_cq_result(struct nvmev_io_work *w)
 	unsigned int result0 = w->result0;
 	unsigned int result1 = w->result1;
 
-	struct nvmev_completion_queue *cq = nvmev_vdev->cqes[cqid];
+	struct nvmev_completion_queue *cq = READ_ONCE(nvmev_vdev->cqes[cqid]);
 	struct nvme_completion *cqe;
 	int cq_head;
 
+	/* Deleted with the request in flight; nowhere to post it */
+	if (unlikely(!cq))
+		return true;
+
 	spin_lock(&cq->entry_lock);
 	cq_head = cq->cq_head;
+
+	/* The host CQ head is one past @cq_tail */
+	if ((cq_head + 1) % cq->queue_size == (READ_ONCE(cq->cq_tail) + 1) % cq->queue_size) {
+		spin_unlock(&cq->entry_lock);
+		return false;
+	}
+
 	cqe = &cq_entry(cq_head);
 
 	cqe->command_id = command_id;
@@ -595,171 +1245,704 @@ static void __fill_cq_result(struct nvmev_io_work *w)
 	cq->cq_head = cq_head;
 	cq->interrupt_ready = true;
 	spin_unlock(&cq->entry_lock);
+
+	if (cq->irq_enabled) {
+		set_bit(cqid, nvmev_vdev->irq_pending_cqs);
+		__kick_irq_owner(cqid);
+	}
+
+	return true;
 }
 
-static int nvmev_io_worker(void *data)
+/*
+ * @copy_ring has a single producer, its owner, but any worker may pop from
+ * it; a slot is claimed by advancing @head with cmpxchg.
+ */
+static unsigned int __copy_ring_pop(struct nvmev_io_ring *ring)
 {
-	struct nvmev_io_worker *worker = (struct nvmev_io_worker *)data;
-	struct nvmev_ns *ns;
-	static unsigned long last_io_time = 0;
+	unsigned int head, entry;
 
-#ifdef PERF_DEBUG
-	static unsigned long long intr_clock[NR_MAX_IO_QUEUE + 1];
-	static unsigned long long intr_counter[NR_MAX_IO_QUEUE + 1];
+	do {
+		head = READ_ONCE(ring->head);
+		if (head == smp_load_acquire(&ring->tail))
+			return -1;
+		entry = READ_ONCE(ring->entries[head & ring->mask]);
+	} while (cmpxchg(&ring->head, head, head + 1) != head);
 
-	unsigned long long prev_clock;
-#endif
+	return entry;
+}
 
-	NVMEV_INFO("%s started on cpu %d (node %d)\n", worker->thread_name, smp_processor_id(),
-		   cpu_to_node(smp_processor_id()));
+static void __copy_ring_push(struct nvmev_io_ring *ring, unsigned int entry)
+{
+	/*
+	 * Indexes of requests copied at their completion stay in the ring until
+	 * popped. Should it be full, leave the copy to the completion.
+	 */
+	if (ring->next_tail - READ_ONCE(ring->head) > ring->mask)
+		return;
 
-	while (!kthread_should_stop()) {
-		unsigned long long curr_nsecs_wall = __get_wallclock();
-		unsigned long long curr_nsecs_local = local_clock();
-		long long delta = curr_nsecs_wall - curr_nsecs_local;
+	__ring_push(ring, entry);
+}
 
-		volatile unsigned int curr = worker->io_seq;
-		int qidx;
+/* Wake up to @nr copy threads sleeping while idle on newly published copies */
+static void __kick_copy_threads(unsigned int nr)
+{
+	unsigned int i;
 
-		while (curr != -1) {
-			struct nvmev_io_work *w = &worker->work_queue[curr];
-			unsigned long long curr_nsecs = local_clock() + delta;
-			worker->latest_nsecs = curr_nsecs;
+	for (i = 0; i < nvmev_vdev->config.nr_copy_threads && nr; i++) {
+		struct nvmev_copy_thread *thread = &nvmev_vdev->copy_threads[i];
 
-			if (w->is_completed == true) {
-				curr = w->next;
-				continue;
-			}
+		if (nvmev_idle_kick(&thread->idle, thread->task_struct))
+			nr--;
+	}
+}
+
+static inline bool __claim_copy(struct nvmev_io_work *w)
+{
+	return atomic_cmpxchg(&w->copy_state, NVMEV_COPY_PENDING, NVMEV_COPY_RUNNING) ==
+	       NVMEV_COPY_PENDING;
+}
+
+/* Publish the copied data of @w to the worker completing it */
+static void __copy_done(struct nvmev_io_work *w, unsigned int status)
+{
+	unsigned long long nsecs_done;
 
-			if (w->is_copied == false) {
-#ifdef PERF_DEBUG
-				w->nsecs_copy_start = local_clock() + delta;
+	/* Keep the error of the FTL, if any */
+	if (status != NVME_SC_SUCCESS && w->status == NVME_SC_SUCCESS)
+		w->status = status;
+
+	/*
+	 * Non-temporal stores are not ordered by the release of copy_state.
+	 * Fence regardless of the thresholds, which may change meanwhile.
+	 */
+	wmb();
+
+	nsecs_done = local_clock();
+	w->nsecs_copy_done = nsecs_done;
+
+	trace_nvmev_copy_done(w->sqid, w->command_id, nsecs_done);
+
+	w->is_copied = true;
+	atomic_set_release(&w->copy_state, NVMEV_COPY_DONE);
+}
+
+/* Called from the DMA completion context once all transfers of @w finish */
+static void __dma_done(struct ioat_dma_batch *batch)
+{
+	struct nvmev_io_work *w = container_of(batch, struct nvmev_io_work, dma);
+
+	__copy_done(w, READ_ONCE(batch->error) ? NVME_SC_DATA_XFER_ERROR : NVME_SC_SUCCESS);
+}
+
+/*
+ * Publish @w to be copied in chunks if it is larger than copy_chunk_kb and
+ * copy threads are there to share them. Returns false to copy it at once.
+ */
+static bool __split_copy(struct nvmev_io_work *w)
+{
+	struct nvmev_split_copies *split = &nvmev_vdev->split_copies;
+	size_t chunk_size = (size_t)READ_ONCE(nvmev_vdev->config.copy_chunk_kb) << 10;
+	size_t size;
+
+	if (!chunk_size || !nvmev_vdev->copy_threads || IS_ENABLED(CONFIG_HIGHMEM))
+		return false;
+
+	if (w->cmd.common.opcode != nvme_cmd_write && w->cmd.common.opcode != nvme_cmd_read &&
+	    w->cmd.common.opcode != nvme_cmd_zone_append)
+		return false;
+
+#if (BASE_SSD == KV_PROTOTYPE)
+	if (nvmev_vdev->ns[0].identify_io_cmd(&nvmev_vdev->ns[0], w->cmd))
+		return false;
 #endif
-				if (w->is_internal) {
-					;
-				} else if (io_using_dma) {
-					__do_perform_io_using_dma(w->sqid, w->sq_entry);
-				} else {
+
+	chunk_size = round_up(chunk_size, PAGE_SIZE);
+	size = __cmd_io_size(&w->cmd.rw);
+	if (size <= chunk_size)
+		return false;
+
+	w->chunk_size = chunk_size;
+	w->nr_chunks = DIV_ROUND_UP(size, chunk_size);
+	w->next_chunk = 0;
+	w->chunk_status = NVME_SC_SUCCESS;
+	atomic_set(&w->chunks_left, w->nr_chunks);
+
+	spin_lock(&split->lock);
+	if (split->nr_works == NR_MAX_SPLIT_WORKS) {
+		spin_unlock(&split->lock);
+		return false;
+	}
+	split->works[split->nr_works++] = w;
+	spin_unlock(&split->lock);
+
+	/* The caller takes chunks as well */
+	__kick_copy_threads(w->nr_chunks - 1);
+
+	return true;
+}
+
+/*
+ * Copy a chunk of a split request; only of @only if given. Returns false if
+ * there is no chunk left to take.
+ */
+static bool __copy_one_chunk(struct nvmev_io_worker_stat *stat, struct nvmev_remap_cache *cache,
+			     struct nvmev_io_work *only)
+{
+	struct nvmev_split_copies *split = &nvmev_vdev->split_copies;
+	struct nvmev_io_work *w = NULL;
+	unsigned long long nsecs_start;
+	unsigned int i, chunk, status;
+	size_t from, to;
+
+	if (READ_ONCE(split->nr_works) == 0)
+		return false;
+
+	spin_lock(&split->lock);
+	for (i = 0; i < split->nr_works; i++) {
+		if (!only || split->works[i] == only) {
+			w = split->works[i];
+			break;
+		}
+	}
+	if (w) {
+		chunk = w->next_chunk++;
+		if (w->next_chunk == w->nr_chunks)
+			split->works[i] = split->works[--split->nr_works];
+	}
+	spin_unlock(&split->lock);
+
+	if (!w)
+		return false;
+
+	nsecs_start = local_clock();
+
+	from = (size_t)chunk * w->chunk_size;
+	to = min(from + w->chunk_size, __cmd_io_size(&w->cmd.rw));
+	status = __do_perform_io_range(&w->cmd.rw, cache, from, to);
+	if (status != NVME_SC_SUCCESS)
+		cmpxchg(&w->chunk_status, NVME_SC_SUCCESS, status);
+
+	/* The last one fences only its own non-temporal stores */
+	wmb();
+
+	if (atomic_dec_and_test(&w->chunks_left))
+		__copy_done(w, READ_ONCE(w->chunk_status));
+
+	stat->nsecs_copy += local_clock() - nsecs_start;
+	stat->nr_chunks++;
+
+	return true;
+}
+
+/*
+ * Copy the data of @w. With DMA, this only queues the transfers and returns;
+ * the copy is marked done from their completion while the caller moves on.
+ * A large copy may be split into chunks, in which case the caller returns
+ * once all of them are taken, possibly before the copy threads finish theirs.
+ * Either way, the data is in place only once @w->copy_state is done.
+ */
+static void __copy_data(struct nvmev_io_worker_stat *stat, struct nvmev_remap_cache *cache,
+			struct nvmev_io_work *w)
+{
+	unsigned long long nsecs_start = local_clock();
+	unsigned int status = NVME_SC_SUCCESS;
+	struct nvmev_ns *data_ns = __data_ns(w);
 #if (BASE_SSD == KV_PROTOTYPE)
-					struct nvmev_submission_queue *sq =
-						nvmev_vdev->sqes[w->sqid];
-					ns = &nvmev_vdev->ns[0];
-					if (ns->identify_io_cmd(ns, sq_entry(w->sq_entry))) {
-						w->result0 = ns->perform_io_cmd(
-							ns, &sq_entry(w->sq_entry), &(w->status));
-					} else {
-						__do_perform_io(w->sqid, w->sq_entry);
-					}
-#else 
-					__do_perform_io(w->sqid, w->sq_entry);
+	struct nvmev_ns *ns = &nvmev_vdev->ns[0];
 #endif
-				}
 
-#ifdef PERF_DEBUG
-				w->nsecs_copy_done = local_clock() + delta;
+	w->nsecs_copy_start = nsecs_start;
+	trace_nvmev_copy_start(w->sqid, w->command_id, nsecs_start);
+
+	if (data_ns && data_ns->timing_only) {
+		status = __do_perform_io_timing_only(&w->cmd.rw, cache);
+		__copy_done(w, status);
+	} else if (data_ns && data_ns->thin) {
+		status = __do_perform_io_thin(&w->cmd.rw, cache);
+		__copy_done(w, status);
+	} else if (io_using_dma) {
+		ioat_dma_batch_init(&w->dma, __dma_done);
+		status = __do_perform_io_using_dma(&w->cmd.rw, &w->dma, cache);
+		if (status != NVME_SC_SUCCESS && w->status == NVME_SC_SUCCESS)
+			w->status = status;
+		ioat_dma_batch_submit(&w->dma);
+	} else if (__split_copy(w)) {
+		while (__copy_one_chunk(stat, cache, w))
+			;
+
+		/* The chunks are accounted on their own */
+		stat->nr_copied++;
+		return;
+	} else {
+#if (BASE_SSD == KV_PROTOTYPE)
+		if (ns->identify_io_cmd(ns, w->cmd)) {
+			w->result0 = ns->perform_io_cmd(ns, &w->cmd, &(w->status));
+		} else {
+			status = __do_perform_io(&w->cmd.rw, cache);
+		}
+#else
+		status = __do_perform_io(&w->cmd.rw, cache);
 #endif
-				w->is_copied = true;
-				last_io_time = jiffies;
+		__copy_done(w, status);
+	}
 
-				NVMEV_DEBUG_VERBOSE("%s: copied %u, %d %d %d\n", worker->thread_name, curr,
-					    w->sqid, w->cqid, w->sq_entry);
-			}
+	/* Only the submission for DMA */
+	stat->nsecs_copy += local_clock() - nsecs_start;
+	stat->nr_copied++;
+}
 
-			if (w->nsecs_target <= curr_nsecs) {
-				if (w->is_internal) {
+/*
+ * Copy the data of a request pending at another worker. Completions are
+ * still posted by the owner of the request in their target time order.
+ * Returns true if a request is stolen.
+ */
+static bool __steal_copy(struct nvmev_io_worker *worker)
+{
+	unsigned int nr_workers = nvmev_vdev->config.nr_io_workers;
+	unsigned int i;
+
+	for (i = 0; i < nr_workers; i++) {
+		unsigned int id = (worker->steal_turn + i) % nr_workers;
+		struct nvmev_io_worker *victim = &nvmev_vdev->io_workers[id];
+		unsigned int entry;
+
+		if (victim == worker)
+			continue;
+
+		while ((entry = __copy_ring_pop(&victim->copy_ring)) != -1) {
+			struct nvmev_io_work *w = __get_work(victim, entry);
+
+			/* Stale or already taken by the owner */
+			if (!__claim_copy(w))
+				continue;
+
+			__copy_data(&worker->stat, &worker->remap_cache, w);
+			worker->stat.nr_stolen++;
+			worker->steal_turn = id; /* Likely to have more */
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static inline unsigned long long __nsecs_between(unsigned long long from, unsigned long long to)
+{
+	/* local_clock() of different CPUs may be slightly off */
+	return to > from ? to - from : 0;
+}
+
+/*
+ * Account the stages of a completed request in the histograms of its SQ.
+ * Only the worker owning the request writes them, so no atomics are needed.
+ */
+static void __record_latency(struct nvmev_io_worker *worker, struct nvmev_io_work *w,
+			     unsigned long long nsecs_late)
+{
+	struct nvmev_lat_hists *hists = worker->lat_hists[w->sqid];
+	int op;
+
+	if (unlikely(!hists)) {
+		hists = kvzalloc_node(sizeof(*hists), GFP_KERNEL, worker->node);
+		if (!hists)
+			return;
+		smp_store_release(&worker->lat_hists[w->sqid], hists);
+	}
+
+	switch (w->cmd.common.opcode) {
+	case nvme_cmd_read:
+		op = NVMEV_LAT_READ;
+		break;
+	case nvme_cmd_write:
+		op = NVMEV_LAT_WRITE;
+		break;
+	default:
+		op = NVMEV_LAT_OTHER;
+		break;
+	}
+
+	lat_hist_add(&hists->hist[op][NVMEV_LAT_FTL], w->nsecs_ftl);
+	lat_hist_add(&hists->hist[op][NVMEV_LAT_QUEUE],
+		     __nsecs_between(w->nsecs_enqueue, w->nsecs_copy_start));
+	lat_hist_add(&hists->hist[op][NVMEV_LAT_COPY],
+		     __nsecs_between(w->nsecs_copy_start, w->nsecs_copy_done));
+	lat_hist_add(&hists->hist[op][NVMEV_LAT_LATE], nsecs_late);
+}
+
+/*
+ * Complete the expired request @entry; post its CQE or release its buffer.
+ * Returns false if its CQ is full (or already found full in @cq_full), in
+ * which case the request should be retried later.
+ */
+static bool __complete_io(struct nvmev_io_worker *worker, unsigned int entry,
+			  unsigned long *cq_full, long long delta)
+{
+	struct nvmev_io_work *w = __get_work(worker, entry);
+
+	/*
+	 * Data should be in place before posting the completion. Copy it now
+	 * if no one has started yet; a copy through DMA only gets queued, and
+	 * the chunks of a split copy may still be copied by the copy threads
+	 * once all of them are taken, so wait for it to finish either way.
+	 */
+	if (atomic_read_acquire(&w->copy_state) != NVMEV_COPY_DONE) {
+		if (__claim_copy(w))
+			__copy_data(&worker->stat, &worker->remap_cache, w);
+
+		while (atomic_read_acquire(&w->copy_state) != NVMEV_COPY_DONE)
+			cpu_relax();
+	}
+
+	if (w->is_internal) {
 #if (SUPPORTED_SSD_TYPE(CONV) || SUPPORTED_SSD_TYPE(ZNS))
-					buffer_release((struct buffer *)w->write_buffer,
-						       w->buffs_to_release);
+		buffer_release((struct buffer *)w->write_buffer, w->buffs_to_release);
 #endif
-				} else {
-					__fill_cq_result(w);
-				}
-
-				NVMEV_DEBUG_VERBOSE("%s: completed %u, %d %d %d\n", worker->thread_name, curr,
-					    w->sqid, w->cqid, w->sq_entry);
-
-#ifdef PERF_DEBUG
-				w->nsecs_cq_filled = local_clock() + delta;
-				trace_printk("%llu %llu %llu %llu %llu %llu\n", w->nsecs_start,
-					     w->nsecs_enqueue - w->nsecs_start,
-					     w->nsecs_copy_start - w->nsecs_start,
-					     w->nsecs_copy_done - w->nsecs_start,
-					     w->nsecs_cq_filled - w->nsecs_start,
-					     w->nsecs_target - w->nsecs_start);
+	} else {
+		unsigned long long nsecs_posted = local_clock() + delta;
+		unsigned long long nsecs_late = nsecs_posted > w->nsecs_target ?
+			nsecs_posted - w->nsecs_target : 0;
+
+		/* Keep the order within a CQ once one of its completions is stalled */
+		if (test_bit(w->cqid, cq_full) || !__fill_cq_result(w)) {
+			__set_bit(w->cqid, cq_full);
+			return false;
+		}
+
+		worker->stat.nr_posted++;
+		worker->stat.nsecs_late_total += nsecs_late;
+		worker->stat.nsecs_late_max = max(worker->stat.nsecs_late_max, nsecs_late);
+
+		__record_latency(worker, w, nsecs_late);
+		trace_nvmev_cqe_post(w->sqid, w->cqid, w->command_id, w->status, w->nsecs_target,
+				     nsecs_late);
+	}
+
+	w->is_completed = true;
+	__ring_push(&worker->return_ring, entry);
+
+	return true;
+}
+
+/*
+ * Complete the requests chained from @curr. The ones stalled on full CQs are
+ * appended to the stalled list in order. Returns true if any is completed.
+ */
+static bool __complete_ios(struct nvmev_io_worker *worker, unsigned int curr,
+			   unsigned long *cq_full, long long delta, bool retry)
+{
+	bool completed = false;
+
+	while (curr != -1) {
+		struct nvmev_io_work *w = __get_work(worker, curr);
+		unsigned int next = w->next;
+
+		if (__complete_io(worker, curr, cq_full, delta)) {
+			completed = true;
+		} else {
+			if (!retry)
+				worker->stat.nr_cq_stalls++;
+
+			w->next = -1;
+			if (worker->stalled_head == -1)
+				worker->stalled_head = curr;
+			else
+				__get_work(worker, worker->stalled_tail)->next = curr;
+			worker->stalled_tail = curr;
+		}
+		curr = next;
+	}
+
+	return completed;
+}
+
+/* Time left until the earliest target time in the wheel */
+static unsigned long long __nsecs_to_next_target(struct nvmev_io_worker *worker, long long delta)
+{
+	unsigned long long nsecs_next = timing_wheel_next_expiry(&worker->wheel);
+	unsigned long long nsecs_now = local_clock() + delta;
+
+	if (nsecs_next == ULLONG_MAX)
+		return ULLONG_MAX;
+	return nsecs_next > nsecs_now ? nsecs_next - nsecs_now : 0;
+}
+
+static bool __io_worker_pending(void *data)
+{
+	struct nvmev_io_worker *worker = (struct nvmev_io_worker *)data;
+#ifdef CONFIG_NVMEV_IO_WORKER_BY_SQ
+	int qidx;
+
+	/* Interrupts of its CQs posted by other workers */
+	for_each_set_bit(qidx, nvmev_vdev->irq_pending_cqs, NR_MAX_IO_QUEUE + 1) {
+		if (worker->id == __get_io_worker(qidx))
+			return true;
+	}
 #endif
-				mb(); /* Reclaimer shall see after here */
-				w->is_completed = true;
+
+	return smp_load_acquire(&worker->submit_ring.tail) != worker->submit_ring.head;
+}
+
+static int nvmev_io_worker(void *data)
+{
+	struct nvmev_io_worker *worker = (struct nvmev_io_worker *)data;
+
+	NVMEV_INFO("%s started on cpu %d (node %d)\n", worker->thread_name, smp_processor_id(),
+		   cpu_to_node(smp_processor_id()));
+
+	nvmev_idle_init(&worker->idle);
+
+	while (!kthread_should_stop()) {
+		unsigned long long curr_nsecs_wall = __get_wallclock();
+		unsigned long long curr_nsecs_local = local_clock();
+		long long delta = curr_nsecs_wall - curr_nsecs_local;
+
+		DECLARE_BITMAP(cq_full, NR_MAX_IO_QUEUE + 1);
+		struct nvmev_io_work *w;
+		unsigned int curr;
+		int qidx, idx;
+		bool active = false;
+		bool copies = false;
+
+		/* New requests wait in the wheel while their data are being copied */
+		while ((curr = __ring_pop(&worker->submit_ring)) != -1) {
+			w = __get_work(worker, curr);
+			w->is_completed = false;
+			active = true;
+
+			if (w->is_internal) {
+				w->is_copied = true;
+				atomic_set(&w->copy_state, NVMEV_COPY_DONE);
+			} else {
+				w->is_copied = false;
+				atomic_set_release(&w->copy_state, NVMEV_COPY_PENDING);
+				__copy_ring_push(&worker->copy_ring, curr);
+				copies = true;
 			}
 
-			curr = w->next;
+			timing_wheel_insert(&worker->wheel, curr, local_clock() + delta);
+		}
+		__ring_publish(&worker->copy_ring);
+		if (copies && nvmev_vdev->copy_threads)
+			__kick_copy_threads(1);
+
+		/* Copy the data ahead of their target time unless copy threads do */
+		while (!nvmev_vdev->copy_threads &&
+		       (curr = __copy_ring_pop(&worker->copy_ring)) != -1) {
+			w = __get_work(worker, curr);
+			if (__claim_copy(w))
+				__copy_data(&worker->stat, &worker->remap_cache, w);
 		}
 
-		for (qidx = 1; qidx <= nvmev_vdev->nr_cq; qidx++) {
-			struct nvmev_completion_queue *cq = nvmev_vdev->cqes[qidx];
+		/* The CQs may be deleted by the admin queue while posting to them */
+		idx = srcu_read_lock(&nvmev_vdev->queue_srcu);
+
+		/*
+		 * Completions stalled on full CQs go before the newly expired ones
+		 * so that each CQ still gets them in the order of their target time.
+		 */
+		bitmap_zero(cq_full, NR_MAX_IO_QUEUE + 1);
+		curr = worker->stalled_head;
+		worker->stalled_head = worker->stalled_tail = -1;
+		if (__complete_ios(worker, curr, cq_full, delta, true))
+			active = true;
+
+		curr = timing_wheel_expire(&worker->wheel, local_clock() + delta);
+		if (__complete_ios(worker, curr, cq_full, delta, false))
+			active = true;
+		__ring_publish(&worker->return_ring);
+
+		/* Keep polling until the host makes room in the CQs */
+		if (worker->stalled_head != -1)
+			active = true;
+
+		if (nvmev_vdev->config.copy_steal && !nvmev_vdev->copy_threads &&
+		    __steal_copy(worker))
+			active = true;
+
+		for_each_set_bit(qidx, nvmev_vdev->irq_pending_cqs, NR_MAX_IO_QUEUE + 1) {
+			struct nvmev_completion_queue *cq = READ_ONCE(nvmev_vdev->cqes[qidx]);
 
 #ifdef CONFIG_NVMEV_IO_WORKER_BY_SQ
 			if ((worker->id) != __get_io_worker(qidx))
 				continue;
 #endif
+			/*
+			 * Clear the pending bit before looking at interrupt_ready so
+			 * that a completion posted in between is not missed.
+			 */
+			clear_bit(qidx, nvmev_vdev->irq_pending_cqs);
+			smp_mb__after_atomic();
+
 			if (cq == NULL || !cq->irq_enabled)
 				continue;
 
-			if (mutex_trylock(&cq->irq_lock)) {
-				if (cq->interrupt_ready == true) {
-#ifdef PERF_DEBUG
-					prev_clock = local_clock();
-#endif
-					cq->interrupt_ready = false;
-					nvmev_signal_irq(cq->irq_vector);
-
-#ifdef PERF_DEBUG
-					intr_clock[qidx] += (local_clock() - prev_clock);
-					intr_counter[qidx]++;
-
-					if (intr_counter[qidx] > 1000) {
-						NVMEV_DEBUG("Intr %d: %llu\n", qidx,
-							    intr_clock[qidx] / intr_counter[qidx]);
-						intr_clock[qidx] = 0;
-						intr_counter[qidx] = 0;
-					}
-#endif
-				}
-				mutex_unlock(&cq->irq_lock);
+			if (!mutex_trylock(&cq->irq_lock)) {
+				/* The lock holder might have checked it already; retry later */
+				set_bit(qidx, nvmev_vdev->irq_pending_cqs);
+				continue;
 			}
+
+			if (cq->interrupt_ready == true) {
+				cq->interrupt_ready = false;
+				nvmev_signal_irq(cq->irq_vector);
+				trace_nvmev_irq(qidx, cq->irq_vector);
+			}
+			mutex_unlock(&cq->irq_lock);
+		}
+		srcu_read_unlock(&nvmev_vdev->queue_srcu, idx);
+
+		if (nvmev_vdev->config.completion_timer) {
+			nvmev_idle_until(&worker->idle,
+					 active ? 0 : __nsecs_to_next_target(worker, delta),
+					 nvmev_vdev->config.completion_spin_us * 1000ULL,
+					 __io_worker_pending, worker);
+		} else {
+			/* Keep polling while any request is waiting for its target time */
+			nvmev_idle(&worker->idle, active || !timing_wheel_empty(&worker->wheel),
+				   __io_worker_pending, worker);
 		}
-		if (CONFIG_NVMEVIRT_IDLE_TIMEOUT != 0 &&
-		    time_after(jiffies, last_io_time + (CONFIG_NVMEVIRT_IDLE_TIMEOUT * HZ)))
-			schedule_timeout_interruptible(1);
-		else
-			cond_resched();
 	}
 
 	return 0;
 }
 
+static bool __copy_thread_pending(void *data)
+{
+	unsigned int i;
+
+	if (READ_ONCE(nvmev_vdev->split_copies.nr_works))
+		return true;
+
+	for (i = 0; i < nvmev_vdev->config.nr_io_workers; i++) {
+		struct nvmev_io_ring *ring = &nvmev_vdev->io_workers[i].copy_ring;
+
+		if (smp_load_acquire(&ring->tail) != READ_ONCE(ring->head))
+			return true;
+	}
+
+	return false;
+}
+
+static int nvmev_copy_thread(void *data)
+{
+	struct nvmev_copy_thread *thread = (struct nvmev_copy_thread *)data;
+	unsigned int nr_workers = nvmev_vdev->config.nr_io_workers;
+
+	NVMEV_INFO("%s started on cpu %d (node %d)\n", thread->thread_name, smp_processor_id(),
+		   cpu_to_node(smp_processor_id()));
+
+	nvmev_idle_init(&thread->idle);
+
+	while (!kthread_should_stop()) {
+		bool active = false;
+		unsigned int i;
+
+		/* Chunks first; their requests are being copied already */
+		while (__copy_one_chunk(&thread->stat, &thread->remap_cache, NULL))
+			active = true;
+
+		/* One request from each worker at a time not to starve any of them */
+		for (i = 0; i < nr_workers; i++) {
+			struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[i];
+			unsigned int entry;
+
+			while ((entry = __copy_ring_pop(&worker->copy_ring)) != -1) {
+				struct nvmev_io_work *w = __get_work(worker, entry);
+
+				if (!__claim_copy(w))
+					continue;
+
+				__copy_data(&thread->stat, &thread->remap_cache, w);
+				active = true;
+				break;
+			}
+		}
+
+		nvmev_idle(&thread->idle, active, __copy_thread_pending, NULL);
+	}
+
+	return 0;
+}
+
+static void __copy_threads_init(struct nvmev_dev *nvmev_vdev)
+{
+	unsigned int i;
+
+	spin_lock_init(&nvmev_vdev->split_copies.lock);
+	nvmev_vdev->split_copies.nr_works = 0;
+
+	if (nvmev_vdev->config.nr_copy_threads == 0)
+		return;
+
+	nvmev_vdev->copy_threads = kcalloc(nvmev_vdev->config.nr_copy_threads,
+					   sizeof(struct nvmev_copy_thread), GFP_KERNEL);
+
+	for (i = 0; i < nvmev_vdev->config.nr_copy_threads; i++) {
+		struct nvmev_copy_thread *thread = &nvmev_vdev->copy_threads[i];
+
+		thread->id = i;
+		thread->stat.nsecs_since = local_clock();
+		snprintf(thread->thread_name, sizeof(thread->thread_name), "nvmev_copy_%d", i);
+
+		thread->task_struct = kthread_create(nvmev_copy_thread, thread, "%s",
+						     thread->thread_name);
+
+		kthread_bind(thread->task_struct, nvmev_vdev->config.cpu_nr_copy_threads[i]);
+		wake_up_process(thread->task_struct);
+	}
+}
+
+static void __copy_threads_final(struct nvmev_dev *nvmev_vdev)
+{
+	unsigned int i;
+
+	if (!nvmev_vdev->copy_threads)
+		return;
+
+	for (i = 0; i < nvmev_vdev->config.nr_copy_threads; i++) {
+		struct nvmev_copy_thread *thread = &nvmev_vdev->copy_threads[i];
+
+		if (!IS_ERR_OR_NULL(thread->task_struct))
+			kthread_stop(thread->task_struct);
+		__remap_cache_release(&thread->remap_cache);
+	}
+
+	kfree(nvmev_vdev->copy_threads);
+	nvmev_vdev->copy_threads = NULL;
+}
+
 void NVMEV_IO_WORKER_INIT(struct nvmev_dev *nvmev_vdev)
 {
 	unsigned int i, worker_id;
 
 	nvmev_vdev->io_workers =
 		kcalloc(nvmev_vdev->config.nr_io_workers, sizeof(struct nvmev_io_worker), GFP_KERNEL);
-	nvmev_vdev->io_worker_turn = 0;
 
 	for (worker_id = 0; worker_id < nvmev_vdev->config.nr_io_workers; worker_id++) {
 		struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[worker_id];
 
-		worker->work_queue =
-			kzalloc(sizeof(struct nvmev_io_work) * NR_MAX_PARALLEL_IO, GFP_KERNEL);
-		for (i = 0; i < NR_MAX_PARALLEL_IO; i++) {
-			worker->work_queue[i].next = i + 1;
-			worker->work_queue[i].prev = i - 1;
-		}
-		worker->work_queue[NR_MAX_PARALLEL_IO - 1].next = -1;
+		/* The worker touches these on every request; keep them on its node */
+		worker->node = nvmev_cpu_to_node(nvmev_vdev->config.cpu_nr_io_workers[worker_id]);
+
+		/* Rings are sized for the whole pool so that they never overflow */
+		worker->work_queue = kvzalloc_node(
+			array_size(NR_MAX_WORK_CHUNKS, sizeof(struct nvmev_io_work *)), GFP_KERNEL,
+			worker->node);
+		__ring_init(&worker->submit_ring, NR_MAX_PARALLEL_IO, worker->node);
+		__ring_init(&worker->return_ring, NR_MAX_PARALLEL_IO, worker->node);
+		__ring_init(&worker->copy_ring, NR_MAX_PARALLEL_IO, worker->node);
+
 		worker->id = worker_id;
-		worker->free_seq = 0;
-		worker->free_seq_end = NR_MAX_PARALLEL_IO - 1;
-		worker->io_seq = -1;
-		worker->io_seq_end = -1;
+		worker->nr_works = 0;
+		worker->free_seq = -1;
+		worker->stalled_head = worker->stalled_tail = -1;
+		for (i = 0; i < NR_INIT_PARALLEL_IO; i += NR_WORKS_PER_CHUNK)
+			__grow_work_queue(worker, GFP_KERNEL);
+
+		timing_wheel_init(&worker->wheel, worker->work_queue);
+		worker->steal_turn = worker_id + 1;
+		worker->stat.nsecs_since = local_clock();
 
 		snprintf(worker->thread_name, sizeof(worker->thread_name), "nvmev_io_worker_%d", worker_id);
 
@@ -768,11 +1951,15 @@ void NVMEV_IO_WORKER_INIT(struct nvmev_dev *nvmev_vdev)
 		kthread_bind(worker->task_struct, nvmev_vdev->config.cpu_nr_io_workers[worker_id]);
 		wake_up_process(worker->task_struct);
 	}
+
+	__copy_threads_init(nvmev_vdev);
 }
 
 void NVMEV_IO_WORKER_FINAL(struct nvmev_dev *nvmev_vdev)
 {
-	unsigned int i;
+	unsigned int i, j;
+
+	__copy_threads_final(nvmev_vdev);
 
 	for (i = 0; i < nvmev_vdev->config.nr_io_workers; i++) {
 		struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[i];
@@ -781,7 +1968,17 @@ void NVMEV_IO_WORKER_FINAL(struct nvmev_dev *nvmev_vdev)
 			kthread_stop(worker->task_struct);
 		}
 
-		kfree(worker->work_queue);
+		__ring_exit(&worker->submit_ring);
+		__ring_exit(&worker->return_ring);
+		__ring_exit(&worker->copy_ring);
+		__remap_cache_release(&worker->remap_cache);
+
+		for (j = 0; j < NR_MAX_WORK_CHUNKS; j++)
+			kfree(worker->work_queue[j]);
+		kvfree(worker->work_queue);
+
+		for (j = 0; j <= NR_MAX_IO_QUEUE; j++)
+			kvfree(worker->lat_hists[j]);
 	}
 
 	kfree(nvmev_vdev->io_workers);
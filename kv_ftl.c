@@ -6,6 +6,7 @@
 
 #include "nvmev.h"
 #include "kv_ftl.h"
+#include "sgl.h"
 
 static const struct allocator_ops append_only_ops = {
 	.init = append_only_allocator_init,
@@ -582,6 +583,16 @@ static unsigned int __do_perform_kv_io(struct kv_ftl *kv_ftl, struct nvme_kv_com
 	}
 	remaining = length;
 
+	if (nvmev_cmd_uses_sgl(&cmd)) {
+		unsigned int sgl_status = sgl_transfer(nvmev_cmd_sgl(&cmd),
+						       nvmev_vdev->storage_mapped + offset, length,
+						       cmd.common.opcode == nvme_cmd_kv_retrieve, NULL);
+
+		if (sgl_status != NVME_SC_SUCCESS)
+			*status = sgl_status;
+		remaining = 0;
+	}
+
 	while (remaining) {
 		size_t io_size;
 		void *vaddr;
@@ -717,6 +728,17 @@ static unsigned int __do_perform_kv_batch(struct kv_ftl *kv_ftl, struct nvme_kv_
 	remaining = length;
 	offset = 0;
 
+	if (nvmev_cmd_uses_sgl(&cmd)) {
+		unsigned int sgl_status = sgl_transfer(nvmev_cmd_sgl(&cmd), buffer, length, false, NULL);
+
+		/* Nothing to run without the payload */
+		if (sgl_status != NVME_SC_SUCCESS) {
+			*status = sgl_status;
+			sub_cmd_cnt = 0;
+		}
+		remaining = 0;
+	}
+
 	while (remaining) {
 		size_t io_size;
 		void *vaddr;
@@ -851,6 +873,7 @@ static unsigned int kv_iter_read(struct kv_ftl *kv_ftl, struct nvme_kv_command c
 	int prp_offs = 0, prp2_offs = 0;
 	u64 paddr;
 	u64 *paddr_list = NULL;
+	unsigned int sgl_status = NVME_SC_SUCCESS;
 
 	if (handle == NULL) {
 		NVMEV_ERROR("Invalid Iterator Handle");
@@ -896,6 +919,11 @@ static unsigned int kv_iter_read(struct kv_ftl *kv_ftl, struct nvme_kv_command c
 	remaining = buf_offset;
 	offset = 0;
 
+	if (nvmev_cmd_uses_sgl(&cmd)) {
+		sgl_status = sgl_transfer(nvmev_cmd_sgl(&cmd), handle->buf, buf_offset, true, NULL);
+		remaining = 0;
+	}
+
 	while (remaining) {
 		size_t io_size;
 		void *vaddr;
@@ -943,6 +971,8 @@ static unsigned int kv_iter_read(struct kv_ftl *kv_ftl, struct nvme_kv_command c
 	if (end) {
 		*status = 0x393;
 	}
+	if (sgl_status != NVME_SC_SUCCESS)
+		*status = sgl_status;
 
 	return buf_offset;
 }
@@ -1019,7 +1049,7 @@ void kv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *ma
 	struct kv_ftl *kv_ftl;
 	int i;
 
-	kv_ftl = kmalloc(sizeof(struct kv_ftl), GFP_KERNEL);
+	kv_ftl = kmalloc_node(sizeof(struct kv_ftl), GFP_KERNEL, nvmev_cpu_to_node(cpu_nr_dispatcher));
 
 	NVMEV_INFO("KV mapping table: %#010lx-%#010x\n",
 		   nvmev_vdev->config.storage_start + nvmev_vdev->config.storage_size,
@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+
+#include "latency.h"
+
+static const char *const lat_op_names[NR_NVMEV_LAT_OPS] = { "read", "write", "other" };
+static const char *const lat_stage_names[NR_NVMEV_LAT_STAGES] = { "ftl", "queue", "copy",
+								  "late" };
+
+/* Largest value that falls in @bucket */
+static u64 __bucket_upper(unsigned int bucket)
+{
+	unsigned int group = bucket / LAT_NR_SUBS;
+	unsigned int shift;
+
+	if (group == 0)
+		return bucket;
+
+	shift = group + LAT_SUB_BITS - 1;
+	return (1ULL << shift) + ((u64)(bucket % LAT_NR_SUBS + 1) << (shift - LAT_SUB_BITS)) - 1;
+}
+
+/* Upper bound of the @permyriad / 10000 quantile */
+static u64 __percentile(const struct nvmev_lat_hist *hist, unsigned int permyriad)
+{
+	u64 rank = div_u64(hist->count * permyriad + 9999, 10000);
+	u64 seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < LAT_NR_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			return min(__bucket_upper(i), hist->max);
+	}
+
+	return hist->max;
+}
+
+void lat_hists_merge(struct nvmev_lat_hists *dst, const struct nvmev_lat_hists *src)
+{
+	int op, stage, i;
+
+	for (op = 0; op < NR_NVMEV_LAT_OPS; op++) {
+		for (stage = 0; stage < NR_NVMEV_LAT_STAGES; stage++) {
+			struct nvmev_lat_hist *d = &dst->hist[op][stage];
+			const struct nvmev_lat_hist *s = &src->hist[op][stage];
+
+			d->count += s->count;
+			d->total += s->total;
+			d->max = max(d->max, s->max);
+			for (i = 0; i < LAT_NR_BUCKETS; i++)
+				d->buckets[i] += s->buckets[i];
+		}
+	}
+}
+
+/* One line per opcode and stage with samples; all values in ns */
+void lat_hists_show(struct seq_file *m, int sqid, const struct nvmev_lat_hists *hists)
+{
+	int op, stage;
+
+	for (op = 0; op < NR_NVMEV_LAT_OPS; op++) {
+		for (stage = 0; stage < NR_NVMEV_LAT_STAGES; stage++) {
+			const struct nvmev_lat_hist *hist = &hists->hist[op][stage];
+
+			if (hist->count == 0)
+				continue;
+
+			seq_printf(m, "%3d %-5s %-5s %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n",
+				   sqid, lat_op_names[op], lat_stage_names[stage], hist->count,
+				   div64_u64(hist->total, hist->count), __percentile(hist, 5000),
+				   __percentile(hist, 9900), __percentile(hist, 9990),
+				   __percentile(hist, 9999), hist->max);
+		}
+	}
+}
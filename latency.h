@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef _NVMEVIRT_LATENCY_H
+#define _NVMEVIRT_LATENCY_H
+
+#include <linux/bitops.h>
+#include <linux/types.h>
+
+struct seq_file;
+
+enum {
+	NVMEV_LAT_FTL = 0, /* FTL compute time at the dispatcher */
+	NVMEV_LAT_QUEUE, /* handed to the worker until its copy starts */
+	NVMEV_LAT_COPY, /* data copy */
+	NVMEV_LAT_LATE, /* CQE posted - target time */
+	NR_NVMEV_LAT_STAGES,
+};
+
+enum {
+	NVMEV_LAT_READ = 0,
+	NVMEV_LAT_WRITE,
+	NVMEV_LAT_OTHER,
+	NR_NVMEV_LAT_OPS,
+};
+
+/*
+ * Log-linear histogram of latencies in ns. Values below LAT_NR_SUBS have a
+ * bucket each, and every power of two above is split into LAT_NR_SUBS
+ * buckets, so a bucket is within 25% of its values up to ~1100 s.
+ */
+#define LAT_SUB_BITS 2
+#define LAT_NR_SUBS (1 << LAT_SUB_BITS)
+#define LAT_MAX_SHIFT 40
+#define LAT_NR_BUCKETS ((LAT_MAX_SHIFT - LAT_SUB_BITS + 1) * LAT_NR_SUBS)
+
+struct nvmev_lat_hist {
+	u64 count;
+	u64 total;
+	u64 max;
+	u64 buckets[LAT_NR_BUCKETS];
+};
+
+/* All stages of the requests of a SQ, kept by each IO worker */
+struct nvmev_lat_hists {
+	struct nvmev_lat_hist hist[NR_NVMEV_LAT_OPS][NR_NVMEV_LAT_STAGES];
+};
+
+static inline unsigned int lat_hist_bucket(u64 nsecs)
+{
+	unsigned int shift;
+
+	if (nsecs < LAT_NR_SUBS)
+		return nsecs;
+
+	nsecs = min_t(u64, nsecs, (1ULL << LAT_MAX_SHIFT) - 1);
+	shift = fls64(nsecs) - 1;
+
+	return (shift - LAT_SUB_BITS + 1) * LAT_NR_SUBS +
+	       ((nsecs >> (shift - LAT_SUB_BITS)) & (LAT_NR_SUBS - 1));
+}
+
+static inline void lat_hist_add(struct nvmev_lat_hist *hist, u64 nsecs)
+{
+	hist->count++;
+	hist->total += nsecs;
+	if (nsecs > hist->max)
+		hist->max = nsecs;
+	hist->buckets[lat_hist_bucket(nsecs)]++;
+}
+
+void lat_hists_merge(struct nvmev_lat_hists *dst, const struct nvmev_lat_hists *src);
+void lat_hists_show(struct seq_file *m, int sqid, const struct nvmev_lat_hists *hists);
+
+#endif
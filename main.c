@@ -2,6 +2,7 @@
 
 #include <linux/kernel.h>
 #include <linux/kthread.h>
+#include <linux/log2.h>
 #include <linux/types.h>
 #include <linux/init.h>
 #include <linux/module.h>
@@ -10,6 +11,9 @@
 #include <linux/delay.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/sched/clock.h>
+#include <linux/numa.h>
+#include <linux/topology.h>
 
 #ifdef CONFIG_X86
 #include <asm/e820/types.h>
@@ -70,10 +74,29 @@ static unsigned int write_trailing = 0;
 static unsigned int nr_io_units = 8;
 static unsigned int io_unit_shift = 12;
 
+static unsigned int idle_spin_us = CONFIG_NVMEVIRT_IDLE_SPIN_US;
+static unsigned int idle_yield_us = CONFIG_NVMEVIRT_IDLE_YIELD_US;
+static unsigned int idle_sleep_us = CONFIG_NVMEVIRT_IDLE_SLEEP_US;
+
+static bool copy_steal = false;
+static unsigned int nt_write_kb = 0;
+static unsigned int nt_read_kb = 0;
+static unsigned int copy_chunk_kb = 0;
+static unsigned int mdts = 0;
+static bool timing_only[NR_NAMESPACES];
+static bool thin[NR_NAMESPACES];
+static char *ns_size;
+static char *checkpoint;
+static bool checkpoint_data = false;
+static bool completion_timer = false;
+static unsigned int completion_spin_us = 5;
+
 static char *cpus;
+static char *copy_cpus;
+static char *dma_chans;
 static unsigned int debug = 0;
 
-int io_using_dma = false;
+bool io_using_dma = false;
 
 static int set_parse_mem_param(const char *val, const struct kernel_param *kp)
 {
@@ -107,82 +130,234 @@ module_param(nr_io_units, uint, 0444);
 MODULE_PARM_DESC(nr_io_units, "Number of I/O units that operate in parallel");
 module_param(io_unit_shift, uint, 0444);
 MODULE_PARM_DESC(io_unit_shift, "Size of each I/O unit (2^)");
+module_param(idle_spin_us, uint, 0444);
+MODULE_PARM_DESC(idle_spin_us, "Max. time to spin when idle in microseconds");
+module_param(idle_yield_us, uint, 0444);
+MODULE_PARM_DESC(idle_yield_us, "Time to yield the CPU after spinning in microseconds");
+module_param(idle_sleep_us, uint, 0444);
+MODULE_PARM_DESC(idle_sleep_us, "Max. sleep slice when idle in microseconds (0 to never sleep)");
+module_param(copy_steal, bool, 0444);
+MODULE_PARM_DESC(copy_steal, "Let idle I/O workers copy data of requests of busy ones");
+module_param(nt_write_kb, uint, 0444);
+MODULE_PARM_DESC(nt_write_kb, "Min. write size in KiB to copy with non-temporal stores (0 to disable)");
+module_param(nt_read_kb, uint, 0444);
+MODULE_PARM_DESC(nt_read_kb, "Min. read size in KiB to copy with non-temporal stores (0 to disable)");
+module_param(copy_chunk_kb, uint, 0444);
+MODULE_PARM_DESC(copy_chunk_kb, "Chunk size in KiB to split large copies over copy threads (0 to disable)");
+module_param(mdts, uint, 0444);
+MODULE_PARM_DESC(mdts, "Max. data transfer size in 2^ of 4KiB pages (0 for the default of the SSD)");
+module_param_array(timing_only, bool, NULL, 0444);
+MODULE_PARM_DESC(timing_only, "Emulate only the timing of each namespace, not keeping data (e.g., 1,0)");
+module_param_array(thin, bool, NULL, 0444);
+MODULE_PARM_DESC(thin, "Thin-provision each namespace, eliding pages filled with a single byte (e.g., 1,0)");
+module_param(ns_size, charp, 0444);
+MODULE_PARM_DESC(ns_size, "Size of each namespace (e.g., 4T,0); timing-only and thin ones may exceed memmap_size");
+module_param(checkpoint, charp, 0444);
+MODULE_PARM_DESC(checkpoint, "File to restore the FTL state from at load and to save it to at unload");
+module_param(checkpoint_data, bool, 0444);
+MODULE_PARM_DESC(checkpoint_data, "Save and restore the data of the namespaces along with the FTL state");
+module_param(completion_timer, bool, 0444);
+MODULE_PARM_DESC(completion_timer, "Let I/O workers sleep on a timer until the next completion");
+module_param(completion_spin_us, uint, 0444);
+MODULE_PARM_DESC(completion_spin_us, "Time to spin before each completion with completion_timer");
 module_param(cpus, charp, 0444);
-MODULE_PARM_DESC(cpus, "CPU list for process, completion(int.) threads, Seperated by Comma(,)");
+MODULE_PARM_DESC(cpus, "CPU list for process, completion(int.) threads, Seperated by Comma(,). "
+		       "Dispatcher CPUs may be listed before a colon, e.g., 0,1:2,3,4,5. "
+		       "auto[:<nr_dispatchers>]:<nr_io_workers> picks CPUs near the storage");
+module_param(copy_cpus, charp, 0444);
+MODULE_PARM_DESC(copy_cpus, "CPU list for dedicated data copy threads, Seperated by Comma(,)");
+module_param(dma_chans, charp, 0444);
+MODULE_PARM_DESC(dma_chans, "DMA channels to copy data with, Seperated by Comma(,)");
 module_param(debug, uint, 0644);
 
+/*
+ * Once the host has set up the doorbell buffer, it updates the doorbells of
+ * I/O queues in the shadow doorbell buffer and rings the MMIO doorbell only
+ * when EventIdx asks for it. Admin queue doorbells always go through the BAR.
+ */
+static inline u32 __get_db(int dbs_idx)
+{
+	u32 *dbs_shadow = READ_ONCE(nvmev_vdev->dbs_shadow);
+
+	if (dbs_shadow && dbs_idx > 1)
+		return READ_ONCE(dbs_shadow[dbs_idx]);
+
+	return nvmev_vdev->dbs[dbs_idx];
+}
+
+static inline void __update_eventidx(int dbs_idx, u32 db)
+{
+	u32 *dbs_eventidx = READ_ONCE(nvmev_vdev->dbs_eventidx);
+
+	/* We keep polling the shadow doorbells, so never ask for an MMIO write */
+	if (dbs_eventidx)
+		WRITE_ONCE(dbs_eventidx[dbs_idx], db - 1);
+}
+
+/*
+ * Fetch up to @budget commands from SQ @qid and return the number of fetched
+ * commands. @pending is set if the SQ had any command to fetch.
+ */
+static int __nvmev_proc_sq(int qid, int budget, bool *pending)
+{
+	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[qid];
+	int dbs_idx = qid * 2;
+	int new_db, old_db, latest_db;
+	int nr_entries;
+
+	if (sq == NULL)
+		return 0;
+
+	new_db = __get_db(dbs_idx);
+	old_db = nvmev_vdev->old_dbs[dbs_idx];
+	if (new_db == old_db)
+		return 0;
+
+	*pending = true;
+
+	nr_entries = new_db - old_db;
+	if (nr_entries < 0)
+		nr_entries += sq->queue_size;
+	if (nr_entries > budget)
+		new_db = (old_db + budget) % sq->queue_size;
+
+	latest_db = nvmev_proc_io_sq(qid, new_db, old_db);
+	nvmev_vdev->old_dbs[dbs_idx] = latest_db;
+	__update_eventidx(dbs_idx, latest_db);
+
+	nr_entries = latest_db - old_db;
+	if (nr_entries < 0)
+		nr_entries += sq->queue_size;
+	return nr_entries;
+}
+
+/* Next created queue in @map starting from @qid, wrapping around */
+static inline unsigned int __next_active_qid(unsigned long *map, unsigned int qid)
+{
+	qid = find_next_bit(map, NR_MAX_IO_QUEUE + 1, qid);
+	if (qid > NR_MAX_IO_QUEUE)
+		qid = find_first_bit(map, NR_MAX_IO_QUEUE + 1);
+	return qid;
+}
+
+/*
+ * Serve the SQs of priority class @prio (or all SQs if @prio is negative) in
+ * a round-robin fashion, taking at most an arbitration burst of commands from
+ * an SQ at a time, until @credits commands are fetched or no more commands
+ * can be fetched from the class.
+ */
+static void __nvmev_arbitrate(struct nvmev_dispatcher *dispatcher, int prio, int credits,
+			      bool *pending)
+{
+	const int burst = nvmev_vdev->arb_burst >= NVMEV_ARB_BURST_UNLIMITED ?
+		INT_MAX : 1 << nvmev_vdev->arb_burst;
+	unsigned int *turn = &dispatcher->arb_turn[prio < 0 ? 0 : prio];
+	unsigned int first, qid;
+	bool progress;
+
+	do {
+		first = __next_active_qid(dispatcher->sqs, *turn);
+		if (first > NR_MAX_IO_QUEUE)
+			return;
+
+		progress = false;
+		qid = first;
+		do {
+			struct nvmev_submission_queue *sq = nvmev_vdev->sqes[qid];
+			int nr_fetched;
+
+			if (sq != NULL && (prio < 0 || sq->priority == prio)) {
+				nr_fetched = __nvmev_proc_sq(qid, min(burst, credits), pending);
+				if (nr_fetched > 0) {
+					credits -= nr_fetched;
+					progress = true;
+					*turn = qid + 1;
+				}
+			}
+			qid = __next_active_qid(dispatcher->sqs, qid + 1);
+		} while (qid != first && qid <= NR_MAX_IO_QUEUE && credits > 0);
+	} while (progress && credits > 0);
+}
+
 // Returns true if an event is processed
-static bool nvmev_proc_dbs(void)
+static bool nvmev_proc_dbs(struct nvmev_dispatcher *dispatcher)
 {
 	int qid;
 	int dbs_idx;
 	int new_db;
 	int old_db;
+	int prio;
+	int idx;
 	bool updated = false;
 
 	// Admin queue
-	new_db = nvmev_vdev->dbs[0];
-	if (new_db != nvmev_vdev->old_dbs[0]) {
-		nvmev_proc_admin_sq(new_db, nvmev_vdev->old_dbs[0]);
-		nvmev_vdev->old_dbs[0] = new_db;
-		updated = true;
-	}
-	new_db = nvmev_vdev->dbs[1];
-	if (new_db != nvmev_vdev->old_dbs[1]) {
-		nvmev_proc_admin_cq(new_db, nvmev_vdev->old_dbs[1]);
-		nvmev_vdev->old_dbs[1] = new_db;
-		updated = true;
+	if (dispatcher->id == 0) {
+		new_db = nvmev_vdev->dbs[0];
+		if (new_db != nvmev_vdev->old_dbs[0]) {
+			nvmev_proc_admin_sq(new_db, nvmev_vdev->old_dbs[0]);
+			nvmev_vdev->old_dbs[0] = new_db;
+			updated = true;
+		}
+		new_db = nvmev_vdev->dbs[1];
+		if (new_db != nvmev_vdev->old_dbs[1]) {
+			nvmev_proc_admin_cq(new_db, nvmev_vdev->old_dbs[1]);
+			nvmev_vdev->old_dbs[1] = new_db;
+			updated = true;
+		}
 	}
 
+	/* The admin commands above may delete I/O queues, waiting for the readers */
+	idx = srcu_read_lock(&nvmev_vdev->queue_srcu);
+
 	// Submission queues
-	for (qid = 1; qid <= nvmev_vdev->nr_sq; qid++) {
-		if (nvmev_vdev->sqes[qid] == NULL)
-			continue;
-		dbs_idx = qid * 2;
-		new_db = nvmev_vdev->dbs[dbs_idx];
-		old_db = nvmev_vdev->old_dbs[dbs_idx];
-		if (new_db != old_db) {
-			nvmev_vdev->old_dbs[dbs_idx] = nvmev_proc_io_sq(qid, new_db, old_db);
-			updated = true;
-		}
+	if (nvmev_vdev->arb_mechanism == NVME_CC_ARB_WRRU) {
+		/* Urgent class first, then high/medium/low in proportion to their weights */
+		__nvmev_arbitrate(dispatcher, NVMEV_SQ_PRIO_URGENT, INT_MAX, &updated);
+		for (prio = NVMEV_SQ_PRIO_HIGH; prio <= NVMEV_SQ_PRIO_LOW; prio++)
+			__nvmev_arbitrate(dispatcher, prio, nvmev_vdev->arb_weights[prio] + 1,
+					  &updated);
+	} else {
+		__nvmev_arbitrate(dispatcher, -1, INT_MAX, &updated);
 	}
 
 	// Completion queues
-	for (qid = 1; qid <= nvmev_vdev->nr_cq; qid++) {
+	for_each_set_bit(qid, dispatcher->cqs, NR_MAX_IO_QUEUE + 1) {
 		if (nvmev_vdev->cqes[qid] == NULL)
 			continue;
 		dbs_idx = qid * 2 + 1;
-		new_db = nvmev_vdev->dbs[dbs_idx];
+		new_db = __get_db(dbs_idx);
 		old_db = nvmev_vdev->old_dbs[dbs_idx];
 		if (new_db != old_db) {
 			nvmev_proc_io_cq(qid, new_db, old_db);
 			nvmev_vdev->old_dbs[dbs_idx] = new_db;
+			__update_eventidx(dbs_idx, new_db);
 			updated = true;
 		}
 	}
 
+	srcu_read_unlock(&nvmev_vdev->queue_srcu, idx);
+
 	return updated;
 }
 
 static int nvmev_dispatcher(void *data)
 {
-	static unsigned long last_dispatched_time = 0;
+	struct nvmev_dispatcher *dispatcher = (struct nvmev_dispatcher *)data;
+
+	NVMEV_INFO("%s started on cpu %d (node %d)\n", dispatcher->thread_name,
+		   smp_processor_id(), cpu_to_node(smp_processor_id()));
 
-	NVMEV_INFO("nvmev_dispatcher started on cpu %d (node %d)\n",
-		   nvmev_vdev->config.cpu_nr_dispatcher,
-		   cpu_to_node(nvmev_vdev->config.cpu_nr_dispatcher));
+	nvmev_idle_init(&dispatcher->idle);
 
 	while (!kthread_should_stop()) {
-		if (nvmev_proc_bars())
-			last_dispatched_time = jiffies;
-		if (nvmev_proc_dbs())
-			last_dispatched_time = jiffies;
-
-		if (CONFIG_NVMEVIRT_IDLE_TIMEOUT != 0 &&
-		    time_after(jiffies, last_dispatched_time + (CONFIG_NVMEVIRT_IDLE_TIMEOUT * HZ)))
-			schedule_timeout_interruptible(1);
-		else
-			cond_resched();
+		bool active = false;
+
+		if (dispatcher->id == 0 && nvmev_proc_bars())
+			active = true;
+		if (nvmev_proc_dbs(dispatcher))
+			active = true;
+
+		nvmev_idle(&dispatcher->idle, active, NULL, NULL);
 	}
 
 	return 0;
@@ -190,18 +365,50 @@ static int nvmev_dispatcher(void *data)
 
 static void NVMEV_DISPATCHER_INIT(struct nvmev_dev *nvmev_vdev)
 {
-	nvmev_vdev->nvmev_dispatcher = kthread_create(nvmev_dispatcher, NULL, "nvmev_dispatcher");
-	if (nvmev_vdev->config.cpu_nr_dispatcher != -1)
-		kthread_bind(nvmev_vdev->nvmev_dispatcher, nvmev_vdev->config.cpu_nr_dispatcher);
-	wake_up_process(nvmev_vdev->nvmev_dispatcher);
+	unsigned int i;
+
+	nvmev_vdev->dispatchers = kcalloc(nvmev_vdev->config.nr_dispatchers,
+					  sizeof(struct nvmev_dispatcher), GFP_KERNEL);
+
+	for (i = 0; i < nvmev_vdev->config.nr_dispatchers; i++) {
+		struct nvmev_dispatcher *dispatcher = &nvmev_vdev->dispatchers[i];
+		unsigned int cpu_nr = nvmev_vdev->config.cpu_nr_dispatchers[i];
+
+		dispatcher->id = i;
+		dispatcher->io_worker_turn = 0;
+		if (i == 0)
+			snprintf(dispatcher->thread_name, sizeof(dispatcher->thread_name),
+				 "nvmev_dispatcher");
+		else
+			snprintf(dispatcher->thread_name, sizeof(dispatcher->thread_name),
+				 "nvmev_dispatcher_%d", i);
+
+		dispatcher->task_struct =
+			kthread_create(nvmev_dispatcher, dispatcher, "%s", dispatcher->thread_name);
+		if (cpu_nr != -1)
+			kthread_bind(dispatcher->task_struct, cpu_nr);
+		wake_up_process(dispatcher->task_struct);
+	}
 }
 
 static void NVMEV_DISPATCHER_FINAL(struct nvmev_dev *nvmev_vdev)
 {
-	if (!IS_ERR_OR_NULL(nvmev_vdev->nvmev_dispatcher)) {
-		kthread_stop(nvmev_vdev->nvmev_dispatcher);
-		nvmev_vdev->nvmev_dispatcher = NULL;
+	unsigned int i;
+
+	if (!nvmev_vdev->dispatchers)
+		return;
+
+	for (i = 0; i < nvmev_vdev->config.nr_dispatchers; i++) {
+		struct nvmev_dispatcher *dispatcher = &nvmev_vdev->dispatchers[i];
+
+		if (!IS_ERR_OR_NULL(dispatcher->task_struct)) {
+			kthread_stop(dispatcher->task_struct);
+			dispatcher->task_struct = NULL;
+		}
 	}
+
+	kfree(nvmev_vdev->dispatchers);
+	nvmev_vdev->dispatchers = NULL;
 }
 
 #ifdef CONFIG_X86
@@ -304,13 +511,23 @@ static void __print_perf_configs(void)
 
 static int __get_nr_entries(int dbs_idx, int queue_size)
 {
-	int diff = nvmev_vdev->dbs[dbs_idx] - nvmev_vdev->old_dbs[dbs_idx];
+	int diff = __get_db(dbs_idx) - nvmev_vdev->old_dbs[dbs_idx];
 	if (diff < 0) {
 		diff += queue_size;
 	}
 	return diff;
 }
 
+static void __print_idle_stat(struct seq_file *m, const char *name, struct nvmev_idle *idle)
+{
+	seq_printf(m, "%-20s %12llu %12llu %12llu %12llu %10llu %10llu %10llu\n", name,
+		   idle->avg_gap, idle->nsecs_in_state[NVMEV_IDLE_SPIN] / 1000000,
+		   idle->nsecs_in_state[NVMEV_IDLE_YIELD] / 1000000,
+		   idle->nsecs_in_state[NVMEV_IDLE_SLEEP] / 1000000, idle->nr_sleeps,
+		   idle->nr_sleeps ? idle->total_wake_penalty / idle->nr_sleeps : 0,
+		   idle->max_wake_penalty);
+}
+
 static int __proc_file_read(struct seq_file *m, void *data)
 {
 	const char *filename = m->private;
@@ -330,17 +547,19 @@ static int __proc_file_read(struct seq_file *m, void *data)
 		unsigned int nr_dispatch = 0;
 		unsigned int nr_dispatched = 0;
 		unsigned long long total_io = 0;
+		int idx = srcu_read_lock(&nvmev_vdev->queue_srcu);
+
 		for (i = 1; i <= nvmev_vdev->nr_sq; i++) {
-			struct nvmev_submission_queue *sq = nvmev_vdev->sqes[i];
+			struct nvmev_submission_queue *sq = READ_ONCE(nvmev_vdev->sqes[i]);
 			if (!sq)
 				continue;
 
 			seq_printf(m, "%2d: %2u %4u %4u %4u %4u %llu\n", i,
-				   __get_nr_entries(i * 2, sq->queue_size), sq->stat.nr_in_flight,
+				   __get_nr_entries(i * 2, sq->queue_size), atomic_read(&sq->stat.nr_in_flight),
 				   sq->stat.max_nr_in_flight, sq->stat.nr_dispatch,
 				   sq->stat.nr_dispatched, sq->stat.total_io);
 
-			nr_in_flight += sq->stat.nr_in_flight;
+			nr_in_flight += atomic_read(&sq->stat.nr_in_flight);
 			nr_dispatch += sq->stat.nr_dispatch;
 			nr_dispatched += sq->stat.nr_dispatched;
 			total_io += sq->stat.total_io;
@@ -348,8 +567,105 @@ static int __proc_file_read(struct seq_file *m, void *data)
 			barrier();
 			sq->stat.max_nr_in_flight = 0;
 		}
+		srcu_read_unlock(&nvmev_vdev->queue_srcu, idx);
 		seq_printf(m, "total: %u %u %u %llu\n", nr_in_flight, nr_dispatch, nr_dispatched,
 			   total_io);
+
+		/* Per-command dispatcher cost in ns */
+		for (i = 0; nvmev_vdev->dispatchers && i < cfg->nr_dispatchers; i++) {
+			struct nvmev_dispatcher_stat *stat = &nvmev_vdev->dispatchers[i].stat;
+			unsigned long long nr_cmds = max(stat->nr_cmds, 1ULL);
+
+			seq_printf(m, "dispatcher %d: %llu cmds, fetch %llu ftl %llu enqueue %llu\n",
+				   i, stat->nr_cmds, stat->nsecs_fetch / nr_cmds,
+				   stat->nsecs_ftl / nr_cmds, stat->nsecs_enqueue / nr_cmds);
+		}
+
+		/*
+		 * Share of time spent on copying data (including stolen requests) and
+		 * lateness of the completions in ns
+		 */
+		for (i = 0; nvmev_vdev->io_workers && i < cfg->nr_io_workers; i++) {
+			struct nvmev_io_worker_stat *stat = &nvmev_vdev->io_workers[i].stat;
+			unsigned long long elapsed = max(local_clock() - stat->nsecs_since, 1ULL);
+
+			seq_printf(m,
+				   "%s: copy %llu%%, %llu copied, %llu stolen, late avg %llu max %llu, %llu cq stalls, %u entries, %llu remaps\n",
+				   nvmev_vdev->io_workers[i].thread_name,
+				   stat->nsecs_copy * 100 / elapsed, stat->nr_copied, stat->nr_stolen,
+				   stat->nsecs_late_total / max(stat->nr_posted, 1ULL),
+				   stat->nsecs_late_max, stat->nr_cq_stalls,
+				   READ_ONCE(nvmev_vdev->io_workers[i].nr_works),
+				   READ_ONCE(nvmev_vdev->io_workers[i].remap_cache.nr_remaps));
+		}
+		for (i = 0; nvmev_vdev->copy_threads && i < cfg->nr_copy_threads; i++) {
+			struct nvmev_io_worker_stat *stat = &nvmev_vdev->copy_threads[i].stat;
+			unsigned long long elapsed = max(local_clock() - stat->nsecs_since, 1ULL);
+
+			seq_printf(m, "%s: copy %llu%%, %llu copied, %llu chunks, %llu remaps\n",
+				   nvmev_vdev->copy_threads[i].thread_name,
+				   stat->nsecs_copy * 100 / elapsed, stat->nr_copied, stat->nr_chunks,
+				   READ_ONCE(nvmev_vdev->copy_threads[i].remap_cache.nr_remaps));
+		}
+
+		/* Pages of the pool backing the thin-provisioned namespaces */
+		for (i = 0; nvmev_vdev->ns && i < nvmev_vdev->nr_ns; i++) {
+			struct nvmev_thin *thin = nvmev_vdev->ns[i].thin;
+
+			if (!thin)
+				continue;
+
+			seq_printf(m, "ns %d: %u of %u pages in use, %llu pages\n", i,
+				   thin->nr_pool_pages - READ_ONCE(thin->nr_free),
+				   thin->nr_pool_pages, thin->nr_pages);
+		}
+	} else if (strcmp(filename, "latency") == 0) {
+		struct nvmev_lat_hists *hists = kvmalloc(sizeof(*hists), GFP_KERNEL);
+		int qid, i;
+
+		if (!hists)
+			return -ENOMEM;
+
+		/* Merged over the IO workers; racy against them, but only by a few samples */
+		seq_printf(m, "%3s %-5s %-5s %10s %10s %10s %10s %10s %10s %10s\n", "sq", "op",
+			   "stage", "count", "avg", "p50", "p99", "p99.9", "p99.99", "max");
+		for (qid = 1; qid <= NR_MAX_IO_QUEUE; qid++) {
+			bool found = false;
+
+			memset(hists, 0, sizeof(*hists));
+			for (i = 0; nvmev_vdev->io_workers && i < cfg->nr_io_workers; i++) {
+				struct nvmev_lat_hists *src =
+					smp_load_acquire(&nvmev_vdev->io_workers[i].lat_hists[qid]);
+
+				if (!src)
+					continue;
+				lat_hists_merge(hists, src);
+				found = true;
+			}
+			if (found)
+				lat_hists_show(m, qid, hists);
+		}
+
+		kvfree(hists);
+	} else if (strcmp(filename, "copy") == 0) {
+		seq_printf(m, "nt_write_kb %u, nt_read_kb %u, chunk_kb %u\n", cfg->nt_write_kb,
+			   cfg->nt_read_kb, cfg->copy_chunk_kb);
+	} else if (strcmp(filename, "idle") == 0) {
+		int i;
+
+		seq_printf(m, "spin %u us, yield %u us, sleep %u us\n", cfg->idle_spin_us,
+			   cfg->idle_yield_us, cfg->idle_sleep_us);
+		seq_printf(m, "%-20s %12s %12s %12s %12s %10s %10s %10s\n", "thread", "gap(ns)",
+			   "spin(ms)", "yield(ms)", "sleep(ms)", "wakeups", "avg_pen", "max_pen");
+		for (i = 0; nvmev_vdev->dispatchers && i < cfg->nr_dispatchers; i++)
+			__print_idle_stat(m, nvmev_vdev->dispatchers[i].thread_name,
+					  &nvmev_vdev->dispatchers[i].idle);
+		for (i = 0; nvmev_vdev->io_workers && i < cfg->nr_io_workers; i++)
+			__print_idle_stat(m, nvmev_vdev->io_workers[i].thread_name,
+					  &nvmev_vdev->io_workers[i].idle);
+		for (i = 0; nvmev_vdev->copy_threads && i < cfg->nr_copy_threads; i++)
+			__print_idle_stat(m, nvmev_vdev->copy_threads[i].thread_name,
+					  &nvmev_vdev->copy_threads[i].idle);
 	} else if (strcmp(filename, "debug") == 0) {
 		/* Left for later use */
 	}
@@ -368,7 +684,8 @@ static ssize_t __proc_file_write(struct file *file, const char __user *buf, size
 	struct nvmev_config *cfg = &nvmev_vdev->config;
 	size_t nr_copied;
 
-	nr_copied = copy_from_user(input, buf, min(len, sizeof(input)));
+	nr_copied = copy_from_user(input, buf, min(len, sizeof(input) - 1));
+	input[min(len, sizeof(input) - 1) - nr_copied] = '\0';
 
 	if (!strcmp(filename, "read_times")) {
 		ret = sscanf(input, "%u %u %u", &cfg->read_delay, &cfg->read_time,
@@ -393,15 +710,83 @@ static ssize_t __proc_file_write(struct file *file, const char __user *buf, size
 		kfree(old_stat);
 	} else if (!strcmp(filename, "stat")) {
 		int i;
+		int idx = srcu_read_lock(&nvmev_vdev->queue_srcu);
+
 		for (i = 1; i <= nvmev_vdev->nr_sq; i++) {
-			struct nvmev_submission_queue *sq = nvmev_vdev->sqes[i];
+			struct nvmev_submission_queue *sq = READ_ONCE(nvmev_vdev->sqes[i]);
 			if (!sq)
 				continue;
 
 			memset(&sq->stat, 0x00, sizeof(sq->stat));
 		}
+		srcu_read_unlock(&nvmev_vdev->queue_srcu, idx);
+		for (i = 0; nvmev_vdev->dispatchers && i < cfg->nr_dispatchers; i++)
+			memset(&nvmev_vdev->dispatchers[i].stat, 0x00,
+			       sizeof(nvmev_vdev->dispatchers[i].stat));
+		for (i = 0; nvmev_vdev->io_workers && i < cfg->nr_io_workers; i++) {
+			struct nvmev_io_worker_stat *stat = &nvmev_vdev->io_workers[i].stat;
+
+			memset(stat, 0x00, sizeof(*stat));
+			stat->nsecs_since = local_clock();
+		}
+		for (i = 0; nvmev_vdev->copy_threads && i < cfg->nr_copy_threads; i++) {
+			struct nvmev_io_worker_stat *stat = &nvmev_vdev->copy_threads[i].stat;
+
+			memset(stat, 0x00, sizeof(*stat));
+			stat->nsecs_since = local_clock();
+		}
+	} else if (!strcmp(filename, "idle")) {
+		int i;
+
+		/* "<spin_us> <yield_us> <sleep_us>"; statistics are cleared in any case */
+		ret = sscanf(input, "%u %u %u", &cfg->idle_spin_us, &cfg->idle_yield_us,
+			     &cfg->idle_sleep_us);
+
+		for (i = 0; nvmev_vdev->dispatchers && i < cfg->nr_dispatchers; i++)
+			nvmev_idle_reset_stat(&nvmev_vdev->dispatchers[i].idle);
+		for (i = 0; nvmev_vdev->io_workers && i < cfg->nr_io_workers; i++)
+			nvmev_idle_reset_stat(&nvmev_vdev->io_workers[i].idle);
+		for (i = 0; nvmev_vdev->copy_threads && i < cfg->nr_copy_threads; i++)
+			nvmev_idle_reset_stat(&nvmev_vdev->copy_threads[i].idle);
+	} else if (!strcmp(filename, "copy")) {
+		unsigned int nt_write, nt_read, chunk;
+
+		/* "<nt_write_kb> <nt_read_kb> [<chunk_kb>]" */
+		ret = sscanf(input, "%u %u %u", &nt_write, &nt_read, &chunk);
+		if (ret < 2)
+			goto out;
+
+		WRITE_ONCE(cfg->nt_write_kb, nt_write);
+		WRITE_ONCE(cfg->nt_read_kb, nt_read);
+		if (ret == 3)
+			WRITE_ONCE(cfg->copy_chunk_kb, chunk);
+	} else if (!strcmp(filename, "latency")) {
+		int i, qid;
+
+		/* Any write clears the histograms */
+		for (i = 0; nvmev_vdev->io_workers && i < cfg->nr_io_workers; i++) {
+			for (qid = 1; qid <= NR_MAX_IO_QUEUE; qid++) {
+				struct nvmev_lat_hists *hists =
+					smp_load_acquire(&nvmev_vdev->io_workers[i].lat_hists[qid]);
+
+				if (hists)
+					memset(hists, 0, sizeof(*hists));
+			}
+		}
 	} else if (!strcmp(filename, "debug")) {
-		/* Left for later use */
+		unsigned int arg;
+
+		if (sscanf(input, "tw_bench %u", &arg) == 1) {
+			timing_wheel_bench(arg);
+		} else if (!strncmp(input, "tw_bench", 8)) {
+			timing_wheel_bench(1024);
+			timing_wheel_bench(NR_MAX_PARALLEL_IO);
+		} else if (sscanf(input, "copy_bench %u", &arg) == 1) {
+			nvmev_copy_bench(arg);
+		} else if (!strncmp(input, "copy_bench", 10)) {
+			nvmev_copy_bench(128);
+			nvmev_copy_bench(2048);
+		}
 	}
 
 out:
@@ -457,7 +842,11 @@ static void NVMEV_STORAGE_INIT(struct nvmev_dev *nvmev_vdev)
 	nvmev_vdev->proc_io_units =
 		proc_create("io_units", 0664, nvmev_vdev->proc_root, &proc_file_fops);
 	nvmev_vdev->proc_stat = proc_create("stat", 0444, nvmev_vdev->proc_root, &proc_file_fops);
-	nvmev_vdev->proc_debug = proc_create("debug", 0444, nvmev_vdev->proc_root, &proc_file_fops);
+	nvmev_vdev->proc_debug = proc_create("debug", 0664, nvmev_vdev->proc_root, &proc_file_fops);
+	nvmev_vdev->proc_idle = proc_create("idle", 0664, nvmev_vdev->proc_root, &proc_file_fops);
+	nvmev_vdev->proc_latency =
+		proc_create("latency", 0664, nvmev_vdev->proc_root, &proc_file_fops);
+	nvmev_vdev->proc_copy = proc_create("copy", 0664, nvmev_vdev->proc_root, &proc_file_fops);
 }
 
 static void NVMEV_STORAGE_FINAL(struct nvmev_dev *nvmev_vdev)
@@ -467,6 +856,9 @@ static void NVMEV_STORAGE_FINAL(struct nvmev_dev *nvmev_vdev)
 	remove_proc_entry("io_units", nvmev_vdev->proc_root);
 	remove_proc_entry("stat", nvmev_vdev->proc_root);
 	remove_proc_entry("debug", nvmev_vdev->proc_root);
+	remove_proc_entry("idle", nvmev_vdev->proc_root);
+	remove_proc_entry("latency", nvmev_vdev->proc_root);
+	remove_proc_entry("copy", nvmev_vdev->proc_root);
 
 	remove_proc_entry("nvmev", NULL);
 
@@ -477,11 +869,74 @@ static void NVMEV_STORAGE_FINAL(struct nvmev_dev *nvmev_vdev)
 		kfree(nvmev_vdev->io_unit_stat);
 }
 
+/*
+ * "cpus=auto:[<nr_dispatchers>:]<nr_io_workers>" takes the last online CPUs
+ * of the NUMA node the reserved memory belongs to, leaving the first ones to
+ * the rest of the system. The dispatchers come first as in the CPU list.
+ */
+static bool __auto_place_cpus(struct nvmev_config *config, const char *spec)
+{
+	unsigned int nr_dispatchers = 1, nr_io_workers = 1;
+	unsigned int nr_cpus = 0, skip, i = 0;
+	int nid = NUMA_NO_NODE;
+	int cpu;
+
+	if (sscanf(spec, "auto:%u:%u", &nr_dispatchers, &nr_io_workers) != 2) {
+		nr_dispatchers = 1;
+		if (sscanf(spec, "auto:%u", &nr_io_workers) != 1)
+			nr_io_workers = 1;
+	}
+
+	if (nr_dispatchers == 0 || nr_dispatchers > NR_MAX_DISPATCHERS ||
+	    nr_io_workers == 0 || nr_io_workers > ARRAY_SIZE(config->cpu_nr_io_workers)) {
+		NVMEV_ERROR("Invalid cpus=%s\n", spec);
+		return false;
+	}
+
+#ifdef CONFIG_NUMA
+	nid = phys_to_target_node(memmap_start);
+#endif
+	if (nid == NUMA_NO_NODE || !node_online(nid))
+		nid = numa_node_id();
+
+	for_each_cpu(cpu, cpumask_of_node(nid))
+		if (cpu_online(cpu))
+			nr_cpus++;
+
+	if (nr_cpus < nr_dispatchers + nr_io_workers) {
+		NVMEV_ERROR("Node %d has only %u CPUs for %u dispatchers and %u IO workers\n", nid,
+			    nr_cpus, nr_dispatchers, nr_io_workers);
+		return false;
+	}
+
+	skip = nr_cpus - nr_dispatchers - nr_io_workers;
+	for_each_cpu(cpu, cpumask_of_node(nid)) {
+		if (!cpu_online(cpu))
+			continue;
+		if (skip) {
+			skip--;
+			continue;
+		}
+
+		if (i < nr_dispatchers)
+			config->cpu_nr_dispatchers[config->nr_dispatchers++] = cpu;
+		else
+			config->cpu_nr_io_workers[config->nr_io_workers++] = cpu;
+		i++;
+	}
+
+	NVMEV_INFO("Placed %u dispatchers and %u IO workers on node %d\n", nr_dispatchers,
+		   nr_io_workers, nid);
+
+	return true;
+}
+
 static bool __load_configs(struct nvmev_config *config)
 {
 	bool first = true;
 	unsigned int cpu_nr;
 	char *cpu;
+	char *dispatcher_cpus = NULL;
 
 	if (__validate_configs() < 0) {
 		return false;
@@ -506,13 +961,47 @@ static bool __load_configs(struct nvmev_config *config)
 	config->nr_io_units = nr_io_units;
 	config->io_unit_shift = io_unit_shift;
 
+	config->idle_spin_us = idle_spin_us;
+	config->idle_yield_us = idle_yield_us;
+	config->idle_sleep_us = idle_sleep_us;
+	config->copy_steal = copy_steal;
+	config->nt_write_kb = nt_write_kb;
+	config->nt_read_kb = nt_read_kb;
+	config->copy_chunk_kb = copy_chunk_kb;
+	config->completion_timer = completion_timer;
+	config->completion_spin_us = completion_spin_us;
+
 	config->nr_io_workers = 0;
+	config->nr_dispatchers = 0;
 	config->cpu_nr_dispatcher = -1;
 
+	/*
+	 * "cpus=D0,D1,...:W0,W1,..." runs a dispatcher on each CPU before the colon
+	 * and an IO worker on each CPU after it. Without a colon, the first CPU is
+	 * the (only) dispatcher and the rest are IO workers.
+	 */
+	if (cpus && !strncmp(cpus, "auto", 4)) {
+		if (!__auto_place_cpus(config, cpus))
+			return false;
+		cpus = NULL;
+	} else if (cpus && strchr(cpus, ':')) {
+		dispatcher_cpus = strsep(&cpus, ":");
+	}
+
+	while ((cpu = strsep(&dispatcher_cpus, ",")) != NULL) {
+		if (config->nr_dispatchers == NR_MAX_DISPATCHERS) {
+			NVMEV_ERROR("Too many dispatchers (max %d)\n", NR_MAX_DISPATCHERS);
+			return false;
+		}
+		cpu_nr = (unsigned int)simple_strtol(cpu, NULL, 10);
+		config->cpu_nr_dispatchers[config->nr_dispatchers++] = cpu_nr;
+		first = false;
+	}
+
 	while ((cpu = strsep(&cpus, ",")) != NULL) {
 		cpu_nr = (unsigned int)simple_strtol(cpu, NULL, 10);
 		if (first) {
-			config->cpu_nr_dispatcher = cpu_nr;
+			config->cpu_nr_dispatchers[config->nr_dispatchers++] = cpu_nr;
 		} else {
 			config->cpu_nr_io_workers[config->nr_io_workers] = cpu_nr;
 			config->nr_io_workers++;
@@ -520,45 +1009,166 @@ static bool __load_configs(struct nvmev_config *config)
 		first = false;
 	}
 
+	config->nr_copy_threads = 0;
+	while ((cpu = strsep(&copy_cpus, ",")) != NULL) {
+		if (config->nr_copy_threads == NR_MAX_COPY_THREADS) {
+			NVMEV_ERROR("Too many copy threads (max %d)\n", NR_MAX_COPY_THREADS);
+			return false;
+		}
+		cpu_nr = (unsigned int)simple_strtol(cpu, NULL, 10);
+		config->cpu_nr_copy_threads[config->nr_copy_threads++] = cpu_nr;
+	}
+
+	if (config->nr_dispatchers == 0)
+		config->cpu_nr_dispatchers[config->nr_dispatchers++] = -1;
+	config->cpu_nr_dispatcher = config->cpu_nr_dispatchers[0];
+
+	if (config->nr_io_workers < config->nr_dispatchers) {
+		NVMEV_ERROR("Need at least one IO worker per dispatcher (%u dispatchers, %u workers)\n",
+			    config->nr_dispatchers, config->nr_io_workers);
+		return false;
+	}
+
 	return true;
 }
 
+/*
+ * MDTS of the SSD model unless overridden with mdts. A write has to fit in
+ * the write buffer of the FTL at once, so the override is capped at its size.
+ */
+static unsigned int __get_mdts(void)
+{
+#if (BASE_SSD == KV_PROTOTYPE)
+	if (mdts)
+		NVMEV_INFO("mdts is not supported for KV SSDs, using %u\n", MDTS);
+	return MDTS;
+#else
+	/* The number of LBAs is a 16-bit field of the command */
+	unsigned int max_mdts = ilog2((1UL << 16) * LBA_SIZE / PAGE_SIZE);
+	size_t wb_size = 0;
+
+	if (mdts == 0)
+		return MDTS;
+
+#if defined(ZONE_WB_SIZE)
+	wb_size = ZONE_WB_SIZE ? ZONE_WB_SIZE : GLOBAL_WB_SIZE;
+#elif defined(GLOBAL_WB_SIZE)
+	wb_size = GLOBAL_WB_SIZE;
+#endif
+	if (wb_size)
+		max_mdts = min_t(unsigned int, max_mdts, ilog2(wb_size / PAGE_SIZE));
+
+	if (mdts > max_mdts) {
+		NVMEV_INFO("mdts %u exceeds the write buffer, using %u\n", mdts, max_mdts);
+		return max_mdts;
+	}
+
+	return mdts;
+#endif
+}
+
+/* Sizes listed in ns_size in the order of the namespaces; 0 for the default */
+static void __parse_ns_sizes(unsigned long long *sizes)
+{
+	char *list, *p, *size;
+	int i = 0;
+
+	if (!ns_size)
+		return;
+
+	list = p = kstrdup(ns_size, GFP_KERNEL);
+	if (!list)
+		return;
+
+	while ((size = strsep(&p, ",")) != NULL && i < NR_NAMESPACES)
+		sizes[i++] = memparse(size, NULL);
+
+	kfree(list);
+}
+
 static void NVMEV_NAMESPACE_INIT(struct nvmev_dev *nvmev_vdev)
 {
 	unsigned long long remaining_capacity = nvmev_vdev->config.storage_size;
 	void *ns_addr = nvmev_vdev->storage_mapped;
 	const int nr_ns = NR_NAMESPACES; // XXX: allow for dynamic nr_ns
 	const unsigned int disp_no = nvmev_vdev->config.cpu_nr_dispatcher;
+	unsigned long long sizes[NR_NAMESPACES] = { 0 };
 	int i;
 	unsigned long long size;
 
 	struct nvmev_ns *ns = kmalloc(sizeof(struct nvmev_ns) * nr_ns, GFP_KERNEL);
 
+	__parse_ns_sizes(sizes);
+
 	for (i = 0; i < nr_ns; i++) {
-		if (NS_CAPACITY(i) == 0)
+		/* KV SSDs keep the values along with the keys */
+		bool data_less = timing_only[i] && NS_SSD_TYPE(i) != SSD_TYPE_KV;
+		bool thin_ns = thin[i] && !data_less && NS_SSD_TYPE(i) != SSD_TYPE_KV;
+		void *mapped = (data_less || thin_ns) ? NULL : ns_addr;
+		unsigned long long pool_size = 0;
+
+		if ((timing_only[i] || thin[i]) && NS_SSD_TYPE(i) == SSD_TYPE_KV)
+			NVMEV_INFO("ns %d: timing_only and thin are not supported for KV SSDs\n", i);
+
+		if (sizes[i] == 0)
+			sizes[i] = NS_CAPACITY(i);
+
+		/*
+		 * Only the namespaces keeping data take up the reserved memory;
+		 * a thin one uses as much of it as its size for the pool.
+		 */
+		if (data_less || thin_ns)
+			size = sizes[i] ? sizes[i] : remaining_capacity;
+		else if (sizes[i] == 0)
 			size = remaining_capacity;
 		else
-			size = min(NS_CAPACITY(i), remaining_capacity);
+			size = min(sizes[i], remaining_capacity);
+
+		if (thin_ns)
+			pool_size = min(size, remaining_capacity);
 
 		if (NS_SSD_TYPE(i) == SSD_TYPE_NVM)
-			simple_init_namespace(&ns[i], i, size, ns_addr, disp_no);
+			simple_init_namespace(&ns[i], i, size, mapped, disp_no);
 		else if (NS_SSD_TYPE(i) == SSD_TYPE_CONV)
-			conv_init_namespace(&ns[i], i, size, ns_addr, disp_no);
+			conv_init_namespace(&ns[i], i, size, mapped, disp_no);
 		else if (NS_SSD_TYPE(i) == SSD_TYPE_ZNS)
-			zns_init_namespace(&ns[i], i, size, ns_addr, disp_no);
+			zns_init_namespace(&ns[i], i, size, mapped, disp_no);
 		else if (NS_SSD_TYPE(i) == SSD_TYPE_KV)
-			kv_init_namespace(&ns[i], i, size, ns_addr, disp_no);
+			kv_init_namespace(&ns[i], i, size, mapped, disp_no);
 		else
 			BUG_ON(1);
 
-		remaining_capacity -= size;
-		ns_addr += size;
-		NVMEV_INFO("ns %d/%d: size %lld MiB\n", i, nr_ns, BYTE_TO_MB(ns[i].size));
+		spin_lock_init(&ns[i].ftl_lock);
+		ns[i].timing_only = data_less;
+		ns[i].thin = NULL;
+
+		if (thin_ns) {
+			ns[i].thin = kzalloc(sizeof(*ns[i].thin), GFP_KERNEL);
+			if (!ns[i].thin ||
+			    thin_init(ns[i].thin, ns[i].size, ns_addr, pool_size) < 0) {
+				NVMEV_ERROR("ns %d: cannot allocate the page table, timing only\n", i);
+				kfree(ns[i].thin);
+				ns[i].thin = NULL;
+				ns[i].timing_only = true;
+				thin_ns = false;
+				pool_size = 0;
+			}
+		}
+
+		if (thin_ns) {
+			remaining_capacity -= pool_size;
+			ns_addr += pool_size;
+		} else if (!ns[i].timing_only) {
+			remaining_capacity -= size;
+			ns_addr += size;
+		}
+		NVMEV_INFO("ns %d/%d: size %lld MiB%s\n", i, nr_ns, BYTE_TO_MB(ns[i].size),
+			   ns[i].timing_only ? ", timing only" : thin_ns ? ", thin" : "");
 	}
 
 	nvmev_vdev->ns = ns;
 	nvmev_vdev->nr_ns = nr_ns;
-	nvmev_vdev->mdts = MDTS;
+	nvmev_vdev->mdts = __get_mdts();
 }
 
 static void NVMEV_NAMESPACE_FINAL(struct nvmev_dev *nvmev_vdev)
@@ -578,12 +1188,147 @@ static void NVMEV_NAMESPACE_FINAL(struct nvmev_dev *nvmev_vdev)
 			kv_remove_namespace(&ns[i]);
 		else
 			BUG_ON(1);
+
+		if (ns[i].thin) {
+			thin_final(ns[i].thin);
+			kfree(ns[i].thin);
+		}
 	}
 
 	kfree(ns);
 	nvmev_vdev->ns = NULL;
 }
 
+/*
+ * Save the state of the FTLs, and the data if asked, to @checkpoint, so that
+ * the next load starts from an aged device instead of preconditioning it
+ * again. Called with the dispatchers and I/O workers stopped.
+ */
+static void __save_checkpoint(struct nvmev_dev *nvmev_vdev)
+{
+	struct nvmev_ckpt ckpt;
+	struct ckpt_header hdr = {
+		.magic = CKPT_MAGIC,
+		.version = CKPT_VERSION,
+		.base_ssd = BASE_SSD,
+		.nr_ns = nvmev_vdev->nr_ns,
+		.with_data = checkpoint_data,
+	};
+	int i, ret;
+
+	ret = ckpt_open(&ckpt, checkpoint, true);
+	if (ret) {
+		NVMEV_ERROR("Cannot open checkpoint %s (%d)\n", checkpoint, ret);
+		return;
+	}
+
+	ckpt_write(&ckpt, &hdr, sizeof(hdr));
+
+	for (i = 0; i < nvmev_vdev->nr_ns; i++) {
+		struct nvmev_ns *ns = &nvmev_vdev->ns[i];
+		struct ckpt_ns cns = {
+			.type = NS_SSD_TYPE(i),
+			.nr_parts = ns->nr_parts,
+			.size = ns->size,
+			.data_size = checkpoint_data && ns->mapped ? ns->size : 0,
+		};
+
+		ckpt_write(&ckpt, &cns, sizeof(cns));
+
+		if (NS_SSD_TYPE(i) == SSD_TYPE_CONV)
+			conv_save_namespace(ns, &ckpt);
+		else if (NS_SSD_TYPE(i) == SSD_TYPE_ZNS)
+			zns_save_namespace(ns, &ckpt);
+		else if (NS_SSD_TYPE(i) == SSD_TYPE_KV)
+			NVMEV_INFO("ns %d: the state of KV SSDs is not saved\n", i);
+
+		if (cns.data_size)
+			ckpt_write(&ckpt, ns->mapped, cns.data_size);
+	}
+
+	ret = ckpt_close(&ckpt);
+	if (ret)
+		NVMEV_ERROR("Cannot save checkpoint %s (%d)\n", checkpoint, ret);
+	else
+		NVMEV_INFO("Checkpoint saved to %s\n", checkpoint);
+}
+
+static int __restore_namespaces(struct nvmev_dev *nvmev_vdev, struct nvmev_ckpt *ckpt)
+{
+	struct ckpt_header hdr;
+	int i, ret = 0;
+
+	ckpt_read(ckpt, &hdr, sizeof(hdr));
+	if (ckpt->error)
+		return ckpt->error;
+
+	if (hdr.magic != CKPT_MAGIC || hdr.version != CKPT_VERSION ||
+	    hdr.base_ssd != BASE_SSD || hdr.nr_ns != nvmev_vdev->nr_ns) {
+		NVMEV_ERROR("Checkpoint is not of this device\n");
+		return -EINVAL;
+	}
+
+	for (i = 0; i < nvmev_vdev->nr_ns; i++) {
+		struct nvmev_ns *ns = &nvmev_vdev->ns[i];
+		struct ckpt_ns cns;
+
+		ckpt_read(ckpt, &cns, sizeof(cns));
+		if (ckpt->error)
+			return ckpt->error;
+
+		if (cns.type != NS_SSD_TYPE(i) || cns.nr_parts != ns->nr_parts ||
+		    cns.size != ns->size ||
+		    (cns.data_size && (cns.data_size != ns->size || !ns->mapped))) {
+			NVMEV_ERROR("ns %d: checkpoint does not match the namespace\n", i);
+			return -EINVAL;
+		}
+
+		if (NS_SSD_TYPE(i) == SSD_TYPE_CONV)
+			ret = conv_restore_namespace(ns, ckpt);
+		else if (NS_SSD_TYPE(i) == SSD_TYPE_ZNS)
+			ret = zns_restore_namespace(ns, ckpt);
+		if (ret)
+			return ret;
+
+		if (cns.data_size)
+			ckpt_read(ckpt, ns->mapped, cns.data_size);
+	}
+
+	return ckpt->error;
+}
+
+/*
+ * Restore the namespaces from @checkpoint, if it exists. Any mismatch leaves
+ * the namespaces in their fresh state, as they would be without it.
+ */
+static void __restore_checkpoint(struct nvmev_dev *nvmev_vdev)
+{
+	struct nvmev_ckpt ckpt;
+	int ret;
+
+	ret = ckpt_open(&ckpt, checkpoint, false);
+	if (ret == -ENOENT) {
+		NVMEV_INFO("No checkpoint %s yet, starting afresh\n", checkpoint);
+		return;
+	} else if (ret) {
+		NVMEV_ERROR("Cannot open checkpoint %s (%d)\n", checkpoint, ret);
+		return;
+	}
+
+	ret = __restore_namespaces(nvmev_vdev, &ckpt);
+	ckpt_close(&ckpt);
+
+	if (ret) {
+		NVMEV_ERROR("Cannot restore checkpoint %s (%d), starting afresh\n", checkpoint,
+			    ret);
+		NVMEV_NAMESPACE_FINAL(nvmev_vdev);
+		NVMEV_NAMESPACE_INIT(nvmev_vdev);
+		return;
+	}
+
+	NVMEV_INFO("Checkpoint restored from %s\n", checkpoint);
+}
+
 static void __print_base_config(void)
 {
 	const char *type = "unknown";
@@ -627,8 +1372,12 @@ static int NVMeV_init(void)
 
 	NVMEV_NAMESPACE_INIT(nvmev_vdev);
 
-	if (io_using_dma) {
-		if (ioat_dma_chan_set("dma7chan0") != 0) {
+	if (checkpoint && *checkpoint)
+		__restore_checkpoint(nvmev_vdev);
+
+	if (dma_chans && *dma_chans) {
+		io_using_dma = true;
+		if (ioat_dma_chan_set(dma_chans) != 0) {
 			io_using_dma = false;
 			NVMEV_ERROR("Cannot use DMA engine, Fall back to memcpy\n");
 		}
@@ -666,6 +1415,9 @@ static void NVMeV_exit(void)
 	NVMEV_DISPATCHER_FINAL(nvmev_vdev);
 	NVMEV_IO_WORKER_FINAL(nvmev_vdev);
 
+	if (checkpoint && *checkpoint)
+		__save_checkpoint(nvmev_vdev);
+
 	NVMEV_NAMESPACE_FINAL(nvmev_vdev);
 	NVMEV_STORAGE_FINAL(nvmev_vdev);
 
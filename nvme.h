@@ -50,6 +50,7 @@ enum {
 	NVME_CC_ARB_RR = 0 << 11,
 	NVME_CC_ARB_WRRU = 1 << 11,
 	NVME_CC_ARB_VS = 7 << 11,
+	NVME_CC_AMS_MASK = 7 << 11,
 	NVME_CC_SHN_NONE = 0 << 14,
 	NVME_CC_SHN_NORMAL = 1 << 14,
 	NVME_CC_SHN_ABRUPT = 2 << 14,
@@ -139,11 +140,16 @@ struct nvme_id_ctrl {
 	__u8 vs[1024];
 };
 
+enum {
+	NVME_CTRL_OACS_DBBUF_SUPP = 1 << 8,
+};
+
 enum {
 	NVME_CTRL_ONCS_COMPARE = 1 << 0,
 	NVME_CTRL_ONCS_WRITE_UNCORRECTABLE = 1 << 1,
 	NVME_CTRL_ONCS_DSM = 1 << 2,
 	NVME_CTRL_VWC_PRESENT = 1 << 0,
+	NVME_CTRL_SGLS_SUPPORTED = 1 << 0, /* without alignment requirements */
 };
 
 struct nvme_lbaf {
@@ -343,6 +349,32 @@ static const char *const __nvme_opcode_strings[] = {
 #define nvme_opcode_string(opcode) \
 	(__nvme_opcode_strings[opcode] ? __nvme_opcode_strings[opcode] : "unknown")
 
+/* PSDT in the command flags; the data pointer is an SGL descriptor if any is set */
+enum {
+	NVME_CMD_SGL_METABUF = (1 << 6),
+	NVME_CMD_SGL_METASEG = (1 << 7),
+	NVME_CMD_SGL_ALL = NVME_CMD_SGL_METABUF | NVME_CMD_SGL_METASEG,
+};
+
+struct nvme_sgl_desc {
+	__le64 addr;
+	__le32 length;
+	__u8 rsvd[3];
+	__u8 type; /* descriptor type << 4 | sub type */
+};
+
+enum {
+	NVME_SGL_FMT_ADDRESS = 0x00,
+	NVME_SGL_FMT_OFFSET = 0x01,
+};
+
+enum {
+	NVME_SGL_FMT_DATA_DESC = 0x00,
+	NVME_SGL_FMT_BIT_BUCKET_DESC = 0x01,
+	NVME_SGL_FMT_SEG_DESC = 0x02,
+	NVME_SGL_FMT_LAST_SEG_DESC = 0x03,
+};
+
 struct nvme_common_command {
 	__u8 opcode;
 	__u8 flags;
@@ -5,9 +5,15 @@
 
 #include <linux/pci.h>
 #include <linux/msi.h>
+#include <linux/srcu.h>
 #include <asm/apic.h>
 
 #include "nvme.h"
+#include "idle.h"
+#include "timing_wheel.h"
+#include "latency.h"
+#include "dma.h"
+#include "thin.h"
 
 #define CONFIG_NVMEV_IO_WORKER_BY_SQ
 #undef CONFIG_NVMEV_FAST_X86_IRQ_HANDLING
@@ -17,17 +23,19 @@
 #undef CONFIG_NVMEV_DEBUG_VERBOSE
 
 /*
- * If CONFIG_NVMEVIRT_IDLE_TIMEOUT is set, sleep for a jiffie after
- * CONFIG_NVMEVIRT_IDLE_TIMEOUT seconds have passed to lower CPU power
- * consumption on idle.
+ * Default thresholds of the adaptive idle policy (see idle.c), tunable with
+ * the idle_spin_us, idle_yield_us and idle_sleep_us parameters or through
+ * /proc/nvmev/idle.
  *
- * This may introduce a (1000/CONFIG_HZ) ms processing latency penalty
- * when exiting an I/O idle state.
- *
- * The default is set to 60 seconds, which is extremely conservative and
- * should not have an impact on I/O testing.
+ * An idle dispatcher or IO worker spins for up to IDLE_SPIN_US, yields the
+ * CPU for IDLE_YIELD_US more, and then sleeps on an hrtimer for slices of at
+ * most IDLE_SLEEP_US. The first I/O after an idle period may thus see up to
+ * IDLE_SLEEP_US (plus the timer wake-up penalty) of extra latency. Setting
+ * IDLE_SLEEP_US to 0 disables sleeping.
  */
-#define CONFIG_NVMEVIRT_IDLE_TIMEOUT 60
+#define CONFIG_NVMEVIRT_IDLE_SPIN_US 100
+#define CONFIG_NVMEVIRT_IDLE_YIELD_US 1000
+#define CONFIG_NVMEVIRT_IDLE_SLEEP_US 1000
 
 /*************************/
 #define NVMEV_DRV_NAME "NVMeVirt"
@@ -55,7 +63,13 @@
 
 
 #define NR_MAX_IO_QUEUE 72
-#define NR_MAX_PARALLEL_IO 16384
+#define NR_MAX_PARALLEL_IO 65536 /* per IO worker, a power of 2 */
+#define NR_INIT_PARALLEL_IO 1024
+#define NR_WORKS_PER_CHUNK_SHIFT 6
+#define NR_WORKS_PER_CHUNK (1 << NR_WORKS_PER_CHUNK_SHIFT)
+#define NR_MAX_WORK_CHUNKS (NR_MAX_PARALLEL_IO / NR_WORKS_PER_CHUNK)
+#define NR_MAX_DISPATCHERS 8
+#define NR_MAX_COPY_THREADS 32
 
 #define NVMEV_INTX_IRQ 15
 
@@ -86,11 +100,23 @@
 struct nvmev_sq_stat {
 	unsigned int nr_dispatched;
 	unsigned int nr_dispatch;
-	unsigned int nr_in_flight;
+	atomic_t nr_in_flight; /* decremented by the dispatcher owning the CQ */
 	unsigned int max_nr_in_flight;
 	unsigned long long total_io;
 };
 
+/* Priority classes of SQs for weighted round robin arbitration */
+enum {
+	NVMEV_SQ_PRIO_URGENT = 0,
+	NVMEV_SQ_PRIO_HIGH,
+	NVMEV_SQ_PRIO_MEDIUM,
+	NVMEV_SQ_PRIO_LOW,
+	NR_NVMEV_SQ_PRIO,
+};
+
+/* Arbitration Burst value meaning no limit */
+#define NVMEV_ARB_BURST_UNLIMITED 7
+
 struct nvmev_submission_queue {
 	int qid;
 	int cqid;
@@ -153,9 +179,13 @@ struct nvmev_config {
 	unsigned long storage_start; //byte
 	unsigned long storage_size; // byte
 
-	unsigned int cpu_nr_dispatcher;
+	unsigned int cpu_nr_dispatcher; // primary dispatcher, also the reference clock
+	unsigned int nr_dispatchers;
+	unsigned int cpu_nr_dispatchers[NR_MAX_DISPATCHERS];
 	unsigned int nr_io_workers;
 	unsigned int cpu_nr_io_workers[32];
+	unsigned int nr_copy_threads;
+	unsigned int cpu_nr_copy_threads[NR_MAX_COPY_THREADS];
 
 	/* TODO Refactoring storage configurations */
 	unsigned int nr_io_units;
@@ -167,9 +197,39 @@ struct nvmev_config {
 	unsigned int write_delay; // ns
 	unsigned int write_time; // ns
 	unsigned int write_trailing; // ns
+
+	unsigned int idle_spin_us;
+	unsigned int idle_yield_us;
+	unsigned int idle_sleep_us;
+
+	bool copy_steal; /* idle IO workers copy data for busy ones */
+
+	/* Min. size of the commands copied with non-temporal stores; 0 to disable */
+	unsigned int nt_write_kb;
+	unsigned int nt_read_kb;
+
+	/* Copies larger than this are split into chunks shared with the copy threads */
+	unsigned int copy_chunk_kb;
+
+	/* IO workers sleep on an hrtimer until the window before the next target */
+	bool completion_timer;
+	unsigned int completion_spin_us;
+};
+
+/* Progress of the data copy of a request, claimed with cmpxchg */
+enum {
+	NVMEV_COPY_PENDING = 0,
+	NVMEV_COPY_RUNNING,
+	NVMEV_COPY_DONE,
 };
 
+/*
+ * The fields written by the dispatcher and those written by the IO worker
+ * are placed on separate cachelines so that they do not bounce between the
+ * two cores while a request is in flight.
+ */
 struct nvmev_io_work {
+	/* Written by the dispatcher */
 	int sqid;
 	int cqid;
 
@@ -178,14 +238,8 @@ struct nvmev_io_work {
 
 	unsigned long long nsecs_start;
 	unsigned long long nsecs_target;
-
 	unsigned long long nsecs_enqueue;
-	unsigned long long nsecs_copy_start;
-	unsigned long long nsecs_copy_done;
-	unsigned long long nsecs_cq_filled;
-
-	bool is_copied;
-	bool is_completed;
+	unsigned long long nsecs_ftl; /* spent in the FTL */
 
 	unsigned int status;
 	unsigned int result0;
@@ -195,22 +249,192 @@ struct nvmev_io_work {
 	void *write_buffer;
 	size_t buffs_to_release;
 
-	unsigned int next, prev;
+	struct nvme_command cmd; /* SQE fetched by the dispatcher */
+
+	/* Written by the IO worker */
+	unsigned long long nsecs_copy_start ____cacheline_aligned_in_smp;
+	unsigned long long nsecs_copy_done;
+
+	bool is_copied;
+	bool is_completed;
+	atomic_t copy_state; /* may be claimed by another worker */
+	struct ioat_dma_batch dma; /* transfers in flight with DMA */
+
+	/* Copy split into chunks; see struct nvmev_split_copies */
+	size_t chunk_size;
+	unsigned int nr_chunks;
+	unsigned int next_chunk; /* protected by nvmev_split_copies.lock */
+	atomic_t chunks_left; /* not finished yet; the last one marks the copy done */
+	unsigned int chunk_status;
+
+	unsigned int next; /* in a timing wheel slot or in the free list */
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Single-producer single-consumer ring of work queue entry indexes. The
+ * ring is as large as the work queue so that the producer never finds it
+ * full. Entries are pushed and then published at once with @tail; the
+ * consumer looks at @tail only when it runs out of the entries it saw last.
+ */
+struct nvmev_io_ring {
+	unsigned int *entries;
+	unsigned int mask;
+
+	/* Producer side */
+	unsigned int tail ____cacheline_aligned_in_smp; /* published */
+	unsigned int next_tail; /* pushed, not published yet */
+
+	/* Consumer side */
+	unsigned int head ____cacheline_aligned_in_smp;
+	unsigned int cached_tail;
 };
 
+struct nvmev_io_worker_stat {
+	unsigned long long nsecs_since; /* last reset */
+	unsigned long long nsecs_copy; /* copying data of own and stolen requests */
+	unsigned long long nr_copied;
+	unsigned long long nr_stolen;
+	unsigned long long nr_chunks; /* copied for split requests */
+	unsigned long long nr_cq_stalls; /* completions held back by a full CQ */
+
+	/* Lateness of posted completions, i.e., actual post time - target time */
+	unsigned long long nr_posted;
+	unsigned long long nsecs_late_total;
+	unsigned long long nsecs_late_max;
+};
+
+/*
+ * Host memory outside of the direct map (e.g., BARs of peer devices) is
+ * accessed through memremap()ed windows of REMAP_WINDOW_SIZE. Each copying
+ * thread keeps the last NR_REMAP_WINDOWS of them to reuse for the following
+ * requests, and evicts the least recently used one on a miss.
+ */
+#define NR_REMAP_WINDOWS 16
+#define REMAP_WINDOW_SHIFT 21
+#define REMAP_WINDOW_SIZE (1UL << REMAP_WINDOW_SHIFT)
+
+struct nvmev_remap_window {
+	u64 paddr;
+	size_t size; /* a page if the whole window cannot be mapped */
+	void *vaddr; /* NULL if unused */
+	unsigned long long last_used;
+};
+
+struct nvmev_remap_cache {
+	struct nvmev_remap_window windows[NR_REMAP_WINDOWS];
+	unsigned int mru;
+	unsigned long long clock;
+	unsigned long long nr_remaps; /* misses */
+};
+
+/*
+ * Work queue entries cycle through the following. The dispatcher takes a
+ * free entry from @return_ring (or @free_seq) and pushes it to @submit_ring.
+ * The worker pops it from there, keeps it in @wheel until the target time,
+ * and copies the data through @copy_ring in the meantime (or right before
+ * the completion if nobody did). On completion, the worker pushes it back to
+ * @return_ring. @free_seq holds the entries the dispatcher took but did
+ * not use, and is private to the dispatcher as @wheel is to the worker.
+ */
 struct nvmev_io_worker {
-	struct nvmev_io_work *work_queue;
+	/*
+	 * Entries are allocated in chunks on demand up to NR_MAX_PARALLEL_IO,
+	 * so that their indexes stay valid while the pool grows.
+	 */
+	struct nvmev_io_work **work_queue;
+	unsigned int nr_works;
 
 	unsigned int free_seq; /* free io req head index */
-	unsigned int free_seq_end; /* free io req tail index */
-	unsigned int io_seq; /* io req head index */
-	unsigned int io_seq_end; /* io req tail index */
+	struct nvmev_io_ring submit_ring;
+	struct nvmev_io_ring return_ring;
+
+	struct nvmev_timing_wheel wheel;
+
+	/*
+	 * Requests whose data is not copied yet. Any worker may pop from this
+	 * ring when stealing is enabled, but only the owner posts completions.
+	 */
+	struct nvmev_io_ring copy_ring;
+	unsigned int steal_turn;
+
+	/* Expired requests waiting for room in their CQs, in the expiry order */
+	unsigned int stalled_head;
+	unsigned int stalled_tail;
 
-	unsigned long long latest_nsecs;
+	struct nvmev_io_worker_stat stat;
+	struct nvmev_remap_cache remap_cache;
 
+	/* Per-SQ latency histograms, allocated on the first completion of the SQ */
+	struct nvmev_lat_hists *lat_hists[NR_MAX_IO_QUEUE + 1];
+
+	unsigned int id;
+	int node;
+	struct task_struct *task_struct;
+	char thread_name[32];
+
+	struct nvmev_idle idle;
+};
+
+/*
+ * Requests whose copy is split into chunks of copy_chunk_kb. Whoever claimed
+ * the copy publishes the request here and works through its chunks, while
+ * the copy threads take the chunks of any request in between. The chunks
+ * are handed out in order under @lock, and the request is dropped from
+ * @works along with its last chunk; the one finishing the last chunk marks
+ * the request copied.
+ */
+#define NR_MAX_SPLIT_WORKS 64
+
+struct nvmev_split_copies {
+	spinlock_t lock;
+	unsigned int nr_works;
+	struct nvmev_io_work *works[NR_MAX_SPLIT_WORKS];
+};
+
+/*
+ * Optional threads dedicated to data copies. When they exist, IO workers
+ * leave their copy rings to them and only keep the completion time.
+ */
+struct nvmev_copy_thread {
+	unsigned int id;
+	struct nvmev_io_worker_stat stat;
+	struct nvmev_remap_cache remap_cache;
+
+	struct task_struct *task_struct;
+	char thread_name[32];
+
+	struct nvmev_idle idle;
+};
+
+struct nvmev_dispatcher_stat {
+	unsigned long long nr_cmds;
+	unsigned long long nsecs_fetch; /* work entry allocation and SQE copy */
+	unsigned long long nsecs_ftl;
+	unsigned long long nsecs_enqueue;
+};
+
+/*
+ * Each dispatcher owns the SQs and CQs whose (qid - 1) modulo nr_dispatchers
+ * equals its id, along with the IO workers whose id satisfies the same
+ * relation. Dispatcher 0 additionally handles the BAR and the admin queue.
+ */
+struct nvmev_dispatcher {
 	unsigned int id;
+	unsigned int io_worker_turn;
+
+	struct nvmev_dispatcher_stat stat;
+
+	/* IO queues owned by this dispatcher that are currently created */
+	DECLARE_BITMAP(sqs, NR_MAX_IO_QUEUE + 1);
+	DECLARE_BITMAP(cqs, NR_MAX_IO_QUEUE + 1);
+
+	/* Per-class qid to resume round robin arbitration from */
+	unsigned int arb_turn[NR_NVMEV_SQ_PRIO];
+
 	struct task_struct *task_struct;
 	char thread_name[32];
+
+	struct nvmev_idle idle;
 };
 
 struct nvmev_dev {
@@ -225,12 +449,13 @@ struct nvmev_dev {
 	struct pci_dev *pdev;
 
 	struct nvmev_config config;
-	struct task_struct *nvmev_dispatcher;
+	struct nvmev_dispatcher *dispatchers;
 
 	void *storage_mapped;
 
 	struct nvmev_io_worker *io_workers;
-	unsigned int io_worker_turn;
+	struct nvmev_copy_thread *copy_threads;
+	struct nvmev_split_copies split_copies;
 
 	void __iomem *msix_table;
 
@@ -242,6 +467,10 @@ struct nvmev_dev {
 	u32 *old_dbs;
 	u32 __iomem *dbs;
 
+	/* Shadow doorbell and EventIdx buffers in host memory (Doorbell Buffer Config) */
+	u32 *dbs_shadow;
+	u32 *dbs_eventidx;
+
 	struct nvmev_ns *ns;
 	unsigned int nr_ns;
 	unsigned int nr_sq;
@@ -250,15 +479,31 @@ struct nvmev_dev {
 	struct nvmev_admin_queue *admin_q;
 	struct nvmev_submission_queue *sqes[NR_MAX_IO_QUEUE + 1];
 	struct nvmev_completion_queue *cqes[NR_MAX_IO_QUEUE + 1];
+	/*
+	 * Dispatchers and IO workers look up the queues of each other under
+	 * this; the admin commands deleting a queue wait for them before
+	 * freeing it.
+	 */
+	struct srcu_struct queue_srcu;
+	/* CQs having completions not yet signaled to the host */
+	DECLARE_BITMAP(irq_pending_cqs, NR_MAX_IO_QUEUE + 1);
 
 	unsigned int mdts;
 
+	/* Arbitration mechanism selected by CC.AMS and the Arbitration feature */
+	unsigned int arb_mechanism;
+	unsigned int arb_burst; /* log2 of the burst, NVMEV_ARB_BURST_UNLIMITED for no limit */
+	unsigned int arb_weights[NR_NVMEV_SQ_PRIO]; /* 0's based, urgent class unused */
+
 	struct proc_dir_entry *proc_root;
 	struct proc_dir_entry *proc_read_times;
 	struct proc_dir_entry *proc_write_times;
 	struct proc_dir_entry *proc_io_units;
 	struct proc_dir_entry *proc_stat;
 	struct proc_dir_entry *proc_debug;
+	struct proc_dir_entry *proc_idle;
+	struct proc_dir_entry *proc_latency;
+	struct proc_dir_entry *proc_copy;
 
 	unsigned long long *io_unit_stat;
 };
@@ -279,12 +524,17 @@ struct nvmev_ns {
 	uint32_t id;
 	uint32_t csi;
 	uint64_t size;
-	void *mapped;
+	void *mapped; /* NULL if timing_only or thin */
+	bool timing_only; /* data is not kept; reads return zeros */
+	struct nvmev_thin *thin; /* thin-provisioned storage, if any */
 
 	/*conv ftl or zns or kv*/
 	uint32_t nr_parts; // partitions
 	void *ftls; // ftl instances. one ftl per partition
 
+	/* serializes proc_io_cmd when multiple dispatchers share the namespace */
+	spinlock_t ftl_lock;
+
 	/*io command handler*/
 	bool (*proc_io_cmd)(struct nvmev_ns *ns, struct nvmev_request *req,
 			    struct nvmev_result *ret);
@@ -298,6 +548,26 @@ struct nvmev_ns {
 
 // VDEV Init, Final Function
 extern struct nvmev_dev *nvmev_vdev;
+
+static inline unsigned int nvmev_get_dispatcher(int qid)
+{
+	return (qid - 1) % nvmev_vdev->config.nr_dispatchers;
+}
+
+/* NUMA node of @cpu_nr, or NUMA_NO_NODE for a thread not bound to any CPU */
+static inline int nvmev_cpu_to_node(unsigned int cpu_nr)
+{
+	return cpu_nr == -1 ? NUMA_NO_NODE : cpu_to_node(cpu_nr);
+}
+
+static inline struct nvmev_io_work *nvmev_get_work(struct nvmev_io_work **chunks,
+						   unsigned int entry)
+{
+	struct nvmev_io_work *chunk = READ_ONCE(chunks[entry >> NR_WORKS_PER_CHUNK_SHIFT]);
+
+	return &chunk[entry & (NR_WORKS_PER_CHUNK - 1)];
+}
+
 struct nvmev_dev *VDEV_INIT(void);
 void VDEV_FINALIZE(struct nvmev_dev *nvmev_vdev);
 
@@ -318,5 +588,7 @@ void NVMEV_IO_WORKER_INIT(struct nvmev_dev *nvmev_vdev);
 void NVMEV_IO_WORKER_FINAL(struct nvmev_dev *nvmev_vdev);
 int nvmev_proc_io_sq(int qid, int new_db, int old_db);
 void nvmev_proc_io_cq(int qid, int new_db, int old_db);
+void nvmev_copy_bench(unsigned int size_kb);
+void *nvmev_remap(struct nvmev_remap_cache *cache, u64 paddr);
 
 #endif /* _LIB_NVMEV_H */
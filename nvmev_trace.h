@@ -0,0 +1,261 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nvmev
+
+#if !defined(_NVMEVIRT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _NVMEVIRT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Lifecycle of a command in the emulated device. All times are in ns of
+ * the dispatcher clock (__get_wallclock()) unless noted otherwise. Enable
+ * with, e.g., "perf record -e 'nvmev:*'" or bpftrace on tracepoint:nvmev:*.
+ */
+
+TRACE_EVENT(nvmev_sqe_fetch,
+	TP_PROTO(int sqid, int sq_entry, struct nvme_command *cmd),
+	TP_ARGS(sqid, sq_entry, cmd),
+
+	TP_STRUCT__entry(
+		__field(int, sqid)
+		__field(int, sq_entry)
+		__field(u16, cid)
+		__field(u8, opcode)
+		__field(u32, nsid)
+	),
+
+	TP_fast_assign(
+		__entry->sqid = sqid;
+		__entry->sq_entry = sq_entry;
+		__entry->cid = cmd->common.command_id;
+		__entry->opcode = cmd->common.opcode;
+		__entry->nsid = cmd->common.nsid;
+	),
+
+	TP_printk("sq %d entry %d cid %u opcode 0x%x nsid %u", __entry->sqid, __entry->sq_entry,
+		  __entry->cid, __entry->opcode, __entry->nsid)
+);
+
+TRACE_EVENT(nvmev_ftl,
+	TP_PROTO(int sqid, struct nvme_command *cmd, unsigned long long nsecs_start,
+		 unsigned long long nsecs_target, unsigned int status, unsigned long long nsecs_ftl),
+	TP_ARGS(sqid, cmd, nsecs_start, nsecs_target, status, nsecs_ftl),
+
+	TP_STRUCT__entry(
+		__field(int, sqid)
+		__field(u16, cid)
+		__field(u8, opcode)
+		__field(u64, slba)
+		__field(u32, nr_lba)
+		__field(u64, nsecs_start)
+		__field(u64, nsecs_target)
+		__field(u32, status)
+		__field(u64, nsecs_ftl)
+	),
+
+	TP_fast_assign(
+		__entry->sqid = sqid;
+		__entry->cid = cmd->common.command_id;
+		__entry->opcode = cmd->common.opcode;
+		__entry->slba = cmd->rw.slba;
+		__entry->nr_lba = cmd->rw.length + 1;
+		__entry->nsecs_start = nsecs_start;
+		__entry->nsecs_target = nsecs_target;
+		__entry->status = status;
+		__entry->nsecs_ftl = nsecs_ftl;
+	),
+
+	TP_printk("sq %d cid %u opcode 0x%x slba 0x%llx nr_lba %u start %llu target +%llu status 0x%x ftl %llu",
+		  __entry->sqid, __entry->cid, __entry->opcode, __entry->slba, __entry->nr_lba,
+		  __entry->nsecs_start, __entry->nsecs_target - __entry->nsecs_start,
+		  __entry->status, __entry->nsecs_ftl)
+);
+
+TRACE_EVENT(nvmev_internal_op,
+	TP_PROTO(int sqid, unsigned long long nsecs_target, size_t buffs_to_release),
+	TP_ARGS(sqid, nsecs_target, buffs_to_release),
+
+	TP_STRUCT__entry(
+		__field(int, sqid)
+		__field(u64, nsecs_target)
+		__field(size_t, buffs_to_release)
+	),
+
+	TP_fast_assign(
+		__entry->sqid = sqid;
+		__entry->nsecs_target = nsecs_target;
+		__entry->buffs_to_release = buffs_to_release;
+	),
+
+	TP_printk("sq %d target %llu release %zu", __entry->sqid, __entry->nsecs_target,
+		  __entry->buffs_to_release)
+);
+
+TRACE_EVENT(nvmev_nand,
+	TP_PROTO(int cmd, int ch, int lun, int pl, int blk, int pg, unsigned long long stime,
+		 unsigned long long completed),
+	TP_ARGS(cmd, ch, lun, pl, blk, pg, stime, completed),
+
+	TP_STRUCT__entry(
+		__field(int, cmd)
+		__field(int, ch)
+		__field(int, lun)
+		__field(int, pl)
+		__field(int, blk)
+		__field(int, pg)
+		__field(u64, stime)
+		__field(u64, completed)
+	),
+
+	TP_fast_assign(
+		__entry->cmd = cmd;
+		__entry->ch = ch;
+		__entry->lun = lun;
+		__entry->pl = pl;
+		__entry->blk = blk;
+		__entry->pg = pg;
+		__entry->stime = stime;
+		__entry->completed = completed;
+	),
+
+	TP_printk("%s ch %d lun %d pl %d blk %d pg %d start %llu end +%llu",
+		  __print_symbolic(__entry->cmd, { 0, "read" }, { 1, "write" }, { 2, "erase" },
+				   { 3, "nop" }),
+		  __entry->ch, __entry->lun, __entry->pl, __entry->blk, __entry->pg, __entry->stime,
+		  __entry->completed - __entry->stime)
+);
+
+TRACE_EVENT(nvmev_gc,
+	TP_PROTO(int line, int ipc, int vpc, int nr_free_lines),
+	TP_ARGS(line, ipc, vpc, nr_free_lines),
+
+	TP_STRUCT__entry(
+		__field(int, line)
+		__field(int, ipc)
+		__field(int, vpc)
+		__field(int, nr_free_lines)
+	),
+
+	TP_fast_assign(
+		__entry->line = line;
+		__entry->ipc = ipc;
+		__entry->vpc = vpc;
+		__entry->nr_free_lines = nr_free_lines;
+	),
+
+	TP_printk("line %d ipc %d vpc %d free %d", __entry->line, __entry->ipc, __entry->vpc,
+		  __entry->nr_free_lines)
+);
+
+TRACE_EVENT(nvmev_zone_write,
+	TP_PROTO(unsigned int zid, unsigned long long slba, unsigned long long nr_lba,
+		 unsigned int state, unsigned long long wp, unsigned long long nr_lbas_flush),
+	TP_ARGS(zid, slba, nr_lba, state, wp, nr_lbas_flush),
+
+	TP_STRUCT__entry(
+		__field(u32, zid)
+		__field(u64, slba)
+		__field(u64, nr_lba)
+		__field(u32, state)
+		__field(u64, wp)
+		__field(u64, nr_lbas_flush)
+	),
+
+	TP_fast_assign(
+		__entry->zid = zid;
+		__entry->slba = slba;
+		__entry->nr_lba = nr_lba;
+		__entry->state = state;
+		__entry->wp = wp;
+		__entry->nr_lbas_flush = nr_lbas_flush;
+	),
+
+	TP_printk("zid %u slba 0x%llx nr_lba 0x%llx state %u wp 0x%llx flush 0x%llx",
+		  __entry->zid, __entry->slba, __entry->nr_lba, __entry->state, __entry->wp,
+		  __entry->nr_lbas_flush)
+);
+
+/* Copy times are in local_clock() of the copying CPU */
+DECLARE_EVENT_CLASS(nvmev_copy,
+	TP_PROTO(int sqid, unsigned int cid, unsigned long long nsecs),
+	TP_ARGS(sqid, cid, nsecs),
+
+	TP_STRUCT__entry(
+		__field(int, sqid)
+		__field(u16, cid)
+		__field(u64, nsecs)
+	),
+
+	TP_fast_assign(
+		__entry->sqid = sqid;
+		__entry->cid = cid;
+		__entry->nsecs = nsecs;
+	),
+
+	TP_printk("sq %d cid %u at %llu", __entry->sqid, __entry->cid, __entry->nsecs)
+);
+
+DEFINE_EVENT(nvmev_copy, nvmev_copy_start,
+	TP_PROTO(int sqid, unsigned int cid, unsigned long long nsecs),
+	TP_ARGS(sqid, cid, nsecs)
+);
+
+DEFINE_EVENT(nvmev_copy, nvmev_copy_done,
+	TP_PROTO(int sqid, unsigned int cid, unsigned long long nsecs),
+	TP_ARGS(sqid, cid, nsecs)
+);
+
+TRACE_EVENT(nvmev_cqe_post,
+	TP_PROTO(int sqid, int cqid, unsigned int cid, unsigned int status,
+		 unsigned long long nsecs_target, unsigned long long nsecs_late),
+	TP_ARGS(sqid, cqid, cid, status, nsecs_target, nsecs_late),
+
+	TP_STRUCT__entry(
+		__field(int, sqid)
+		__field(int, cqid)
+		__field(u16, cid)
+		__field(u32, status)
+		__field(u64, nsecs_target)
+		__field(u64, nsecs_late)
+	),
+
+	TP_fast_assign(
+		__entry->sqid = sqid;
+		__entry->cqid = cqid;
+		__entry->cid = cid;
+		__entry->status = status;
+		__entry->nsecs_target = nsecs_target;
+		__entry->nsecs_late = nsecs_late;
+	),
+
+	TP_printk("sq %d cq %d cid %u status 0x%x target %llu late %llu", __entry->sqid,
+		  __entry->cqid, __entry->cid, __entry->status, __entry->nsecs_target,
+		  __entry->nsecs_late)
+);
+
+TRACE_EVENT(nvmev_irq,
+	TP_PROTO(int cqid, int vector),
+	TP_ARGS(cqid, vector),
+
+	TP_STRUCT__entry(
+		__field(int, cqid)
+		__field(int, vector)
+	),
+
+	TP_fast_assign(
+		__entry->cqid = cqid;
+		__entry->vector = vector;
+	),
+
+	TP_printk("cq %d vector %d", __entry->cqid, __entry->vector)
+);
+
+#endif /* _NVMEVIRT_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE nvmev_trace
+#include <trace/define_trace.h>
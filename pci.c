@@ -233,6 +233,7 @@ bool nvmev_proc_bars(void)
 			    bar->u_csts);
 		/* Enable */
 		if (bar->cc.en == 1) {
+			nvmev_vdev->arb_mechanism = bar->u_cc & NVME_CC_AMS_MASK;
 			if (nvmev_vdev->admin_q) {
 				bar->csts.rdy = 1;
 			} else {
@@ -240,6 +241,10 @@ bool nvmev_proc_bars(void)
 			}
 		} else if (bar->cc.en == 0) {
 			bar->csts.rdy = 0;
+
+			/* Doorbell buffer config does not survive a controller reset */
+			WRITE_ONCE(nvmev_vdev->dbs_shadow, NULL);
+			WRITE_ONCE(nvmev_vdev->dbs_eventidx, NULL);
 		}
 
 		/* Shutdown */
@@ -375,6 +380,7 @@ static void __init_nvme_ctrl_regs(struct pci_dev *dev)
 			.to = 1,
 			.mpsmin = 0,
 			.mqes = 1024 - 1, // 0-based value
+			.ams = 1, // weighted round robin with urgent priority class
 #if (SUPPORTED_SSD_TYPE(ZNS))
 			.css = CAP_CSS_BIT_SPECIFIC,
 #endif
@@ -444,6 +450,13 @@ struct nvmev_dev *VDEV_INIT(void)
 	nvmev_vdev->extcap = nvmev_vdev->virtDev + OFFS_PCI_EXT_CAP;
 
 	nvmev_vdev->admin_q = NULL;
+	nvmev_vdev->arb_burst = NVMEV_ARB_BURST_UNLIMITED;
+
+	if (init_srcu_struct(&nvmev_vdev->queue_srcu)) {
+		kfree(nvmev_vdev->virtDev);
+		kfree(nvmev_vdev);
+		return NULL;
+	}
 
 	return nvmev_vdev;
 }
@@ -472,6 +485,8 @@ void VDEV_FINALIZE(struct nvmev_dev *nvmev_vdev)
 		kfree(nvmev_vdev->admin_q);
 	}
 
+	cleanup_srcu_struct(&nvmev_vdev->queue_srcu);
+
 	if (nvmev_vdev->virtDev)
 		kfree(nvmev_vdev->virtDev);
 
@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <linux/highmem.h>
+#include <linux/io.h>
+
+#include "nvmev.h"
+#include "sgl.h"
+
+#define SGL_DESC_TYPE(desc) ((desc)->type >> 4)
+#define SGL_DESC_SUBTYPE(desc) ((desc)->type & 0xf)
+
+/*
+ * Copy [@paddr, @paddr + @len) of the host, which must not cross a page.
+ * Memory outside of the direct map goes through @cache if given, and is
+ * mapped for this copy alone otherwise.
+ */
+static void __copy_page(u64 paddr, void *buf, size_t len, bool to_host,
+			struct nvmev_remap_cache *cache)
+{
+	bool direct = pfn_valid(PRP_PFN(paddr));
+	void *page = NULL;
+	void *vaddr;
+
+	if (direct) {
+		page = kmap_atomic_pfn(PRP_PFN(paddr));
+		vaddr = page + (paddr & PAGE_OFFSET_MASK);
+	} else if (cache) {
+		vaddr = nvmev_remap(cache, paddr);
+	} else {
+		page = memremap(paddr & PAGE_MASK, PAGE_SIZE, MEMREMAP_WT);
+		vaddr = page ? page + (paddr & PAGE_OFFSET_MASK) : NULL;
+	}
+
+	if (!vaddr) {
+		NVMEV_ERROR("Cannot map host memory at 0x%llx\n", paddr);
+		return;
+	}
+
+	if (to_host)
+		memcpy(vaddr, buf, len);
+	else
+		memcpy(buf, vaddr, len);
+
+	if (direct)
+		kunmap_atomic(page);
+	else if (page)
+		memunmap(page);
+}
+
+void sgl_iter_init(struct sgl_iter *iter, const struct nvme_sgl_desc *dptr,
+		   struct nvmev_remap_cache *cache)
+{
+	iter->first = *dptr;
+	iter->started = false;
+	iter->next = 0;
+	iter->nr_left = 0;
+	iter->last = false;
+	iter->cache = cache;
+}
+
+/*
+ * Get the next data block in @paddr and @len, skipping segment descriptors.
+ * @len is 0 at the end of the list. Returns an NVMe status code.
+ */
+unsigned int sgl_iter_next(struct sgl_iter *iter, u64 *paddr, u32 *len)
+{
+	struct nvme_sgl_desc desc;
+
+	for (;;) {
+		if (!iter->started) {
+			desc = iter->first;
+			iter->started = true;
+		} else if (iter->nr_left) {
+			/* A descriptor crossing a page cannot be mapped at once */
+			if ((iter->next & PAGE_OFFSET_MASK) > PAGE_SIZE - sizeof(desc))
+				return NVME_SC_SGL_INVALID_LAST;
+
+			__copy_page(iter->next, &desc, sizeof(desc), false, iter->cache);
+			iter->next += sizeof(desc);
+			iter->nr_left--;
+		} else {
+			*len = 0;
+			return NVME_SC_SUCCESS;
+		}
+
+		if (SGL_DESC_SUBTYPE(&desc) != NVME_SGL_FMT_ADDRESS)
+			return NVME_SC_SGL_INVALID_TYPE;
+
+		switch (SGL_DESC_TYPE(&desc)) {
+		case NVME_SGL_FMT_DATA_DESC:
+			if (desc.length == 0)
+				continue;
+
+			*paddr = desc.addr;
+			*len = desc.length;
+			return NVME_SC_SUCCESS;
+
+		case NVME_SGL_FMT_SEG_DESC:
+		case NVME_SGL_FMT_LAST_SEG_DESC:
+			/* Only the last descriptor of a segment may chain another one */
+			if (iter->last || iter->nr_left)
+				return NVME_SC_SGL_INVALID_LAST;
+			if (desc.length == 0 || desc.length % sizeof(desc))
+				return NVME_SC_SGL_INVALID_COUNT;
+
+			iter->next = desc.addr;
+			iter->nr_left = desc.length / sizeof(desc);
+			iter->last = SGL_DESC_TYPE(&desc) == NVME_SGL_FMT_LAST_SEG_DESC;
+			continue;
+
+		default:
+			return NVME_SC_SGL_INVALID_TYPE;
+		}
+	}
+}
+
+/*
+ * Copy @length bytes between @buf and the host memory described by the SGL
+ * starting from @dptr, a page at a time, through @cache if given. Returns an
+ * NVMe status code.
+ */
+unsigned int sgl_transfer(const struct nvme_sgl_desc *dptr, void *buf, size_t length,
+			  bool to_host, struct nvmev_remap_cache *cache)
+{
+	struct sgl_iter iter;
+
+	sgl_iter_init(&iter, dptr, cache);
+
+	while (length) {
+		unsigned int status;
+		u64 paddr;
+		u32 len;
+
+		status = sgl_iter_next(&iter, &paddr, &len);
+		if (status != NVME_SC_SUCCESS)
+			return status;
+		if (len == 0)
+			return NVME_SC_SGL_INVALID_DATA;
+
+		len = min_t(size_t, len, length);
+		length -= len;
+
+		while (len) {
+			size_t io_size = min_t(size_t, len, PAGE_SIZE - (paddr & PAGE_OFFSET_MASK));
+
+			__copy_page(paddr, buf, io_size, to_host, cache);
+			paddr += io_size;
+			buf += io_size;
+			len -= io_size;
+		}
+	}
+
+	return NVME_SC_SUCCESS;
+}
@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef _NVMEVIRT_SGL_H
+#define _NVMEVIRT_SGL_H
+
+#include <linux/types.h>
+
+#include "nvme.h"
+
+struct nvmev_remap_cache;
+
+/*
+ * Walks the data blocks of an SGL. The first descriptor is the one in the
+ * data pointer of the command; segment descriptors chain further segments
+ * of descriptors in the host memory, which are read one at a time.
+ */
+struct sgl_iter {
+	struct nvme_sgl_desc first;
+	bool started;
+
+	u64 next; /* address of the next descriptor in the current segment */
+	unsigned int nr_left; /* descriptors left in the current segment */
+	bool last; /* in the last segment */
+
+	struct nvmev_remap_cache *cache; /* to read the segments through, if any */
+};
+
+static inline bool nvmev_cmd_uses_sgl(const void *cmd)
+{
+	return ((const struct nvme_common_command *)cmd)->flags & NVME_CMD_SGL_ALL;
+}
+
+static inline const struct nvme_sgl_desc *nvmev_cmd_sgl(const void *cmd)
+{
+	return (const struct nvme_sgl_desc *)&((const struct nvme_common_command *)cmd)->prp1;
+}
+
+void sgl_iter_init(struct sgl_iter *iter, const struct nvme_sgl_desc *dptr,
+		   struct nvmev_remap_cache *cache);
+unsigned int sgl_iter_next(struct sgl_iter *iter, u64 *paddr, u32 *len);
+unsigned int sgl_transfer(const struct nvme_sgl_desc *dptr, void *buf, size_t length,
+			  bool to_host, struct nvmev_remap_cache *cache);
+
+#endif /* _NVMEVIRT_SGL_H */
@@ -5,6 +5,7 @@
 
 #include "nvmev.h"
 #include "ssd.h"
+#include "nvmev_trace.h"
 
 static inline uint64_t __get_ioclock(struct ssd *ssd)
 {
@@ -171,11 +172,11 @@ void ssd_init_params(struct ssdparams *spp, uint64_t capacity, uint32_t nparts)
 		BYTE_TO_KB(spp->pgs_per_line * spp->pgsz));
 }
 
-static void ssd_init_nand_page(struct nand_page *pg, struct ssdparams *spp)
+static void ssd_init_nand_page(struct nand_page *pg, struct ssdparams *spp, int node)
 {
 	int i;
 	pg->nsecs = spp->secs_per_pg;
-	pg->sec = kmalloc(sizeof(nand_sec_status_t) * pg->nsecs, GFP_KERNEL);
+	pg->sec = kmalloc_node(sizeof(nand_sec_status_t) * pg->nsecs, GFP_KERNEL, node);
 	for (i = 0; i < pg->nsecs; i++) {
 		pg->sec[i] = SEC_FREE;
 	}
@@ -187,13 +188,13 @@ static void ssd_remove_nand_page(struct nand_page *pg)
 	kfree(pg->sec);
 }
 
-static void ssd_init_nand_blk(struct nand_block *blk, struct ssdparams *spp)
+static void ssd_init_nand_blk(struct nand_block *blk, struct ssdparams *spp, int node)
 {
 	int i;
 	blk->npgs = spp->pgs_per_blk;
-	blk->pg = kmalloc(sizeof(struct nand_page) * blk->npgs, GFP_KERNEL);
+	blk->pg = kmalloc_node(sizeof(struct nand_page) * blk->npgs, GFP_KERNEL, node);
 	for (i = 0; i < blk->npgs; i++) {
-		ssd_init_nand_page(&blk->pg[i], spp);
+		ssd_init_nand_page(&blk->pg[i], spp, node);
 	}
 	blk->ipc = 0;
 	blk->vpc = 0;
@@ -211,13 +212,13 @@ static void ssd_remove_nand_blk(struct nand_block *blk)
 	kfree(blk->pg);
 }
 
-static void ssd_init_nand_plane(struct nand_plane *pl, struct ssdparams *spp)
+static void ssd_init_nand_plane(struct nand_plane *pl, struct ssdparams *spp, int node)
 {
 	int i;
 	pl->nblks = spp->blks_per_pl;
-	pl->blk = kmalloc(sizeof(struct nand_block) * pl->nblks, GFP_KERNEL);
+	pl->blk = kmalloc_node(sizeof(struct nand_block) * pl->nblks, GFP_KERNEL, node);
 	for (i = 0; i < pl->nblks; i++) {
-		ssd_init_nand_blk(&pl->blk[i], spp);
+		ssd_init_nand_blk(&pl->blk[i], spp, node);
 	}
 }
 
@@ -231,13 +232,13 @@ static void ssd_remove_nand_plane(struct nand_plane *pl)
 	kfree(pl->blk);
 }
 
-static void ssd_init_nand_lun(struct nand_lun *lun, struct ssdparams *spp)
+static void ssd_init_nand_lun(struct nand_lun *lun, struct ssdparams *spp, int node)
 {
 	int i;
 	lun->npls = spp->pls_per_lun;
-	lun->pl = kmalloc(sizeof(struct nand_plane) * lun->npls, GFP_KERNEL);
+	lun->pl = kmalloc_node(sizeof(struct nand_plane) * lun->npls, GFP_KERNEL, node);
 	for (i = 0; i < lun->npls; i++) {
-		ssd_init_nand_plane(&lun->pl[i], spp);
+		ssd_init_nand_plane(&lun->pl[i], spp, node);
 	}
 	lun->next_lun_avail_time = 0;
 	lun->busy = false;
@@ -253,16 +254,16 @@ static void ssd_remove_nand_lun(struct nand_lun *lun)
 	kfree(lun->pl);
 }
 
-static void ssd_init_ch(struct ssd_channel *ch, struct ssdparams *spp)
+static void ssd_init_ch(struct ssd_channel *ch, struct ssdparams *spp, int node)
 {
 	int i;
 	ch->nluns = spp->luns_per_ch;
-	ch->lun = kmalloc(sizeof(struct nand_lun) * ch->nluns, GFP_KERNEL);
+	ch->lun = kmalloc_node(sizeof(struct nand_lun) * ch->nluns, GFP_KERNEL, node);
 	for (i = 0; i < ch->nluns; i++) {
-		ssd_init_nand_lun(&ch->lun[i], spp);
+		ssd_init_nand_lun(&ch->lun[i], spp, node);
 	}
 
-	ch->perf_model = kmalloc(sizeof(struct channel_model), GFP_KERNEL);
+	ch->perf_model = kmalloc_node(sizeof(struct channel_model), GFP_KERNEL, node);
 	chmodel_init(ch->perf_model, spp->ch_bandwidth);
 
 	/* Add firmware overhead */
@@ -281,9 +282,9 @@ static void ssd_remove_ch(struct ssd_channel *ch)
 	kfree(ch->lun);
 }
 
-static void ssd_init_pcie(struct ssd_pcie *pcie, struct ssdparams *spp)
+static void ssd_init_pcie(struct ssd_pcie *pcie, struct ssdparams *spp, int node)
 {
-	pcie->perf_model = kmalloc(sizeof(struct channel_model), GFP_KERNEL);
+	pcie->perf_model = kmalloc_node(sizeof(struct channel_model), GFP_KERNEL, node);
 	chmodel_init(pcie->perf_model, spp->pcie_bandwidth);
 }
 
@@ -298,19 +299,23 @@ void ssd_init(struct ssd *ssd, struct ssdparams *spp, uint32_t cpu_nr_dispatcher
 	/* copy spp */
 	ssd->sp = *spp;
 
+	/* The NAND tree is walked by the dispatcher on every command; keep it local */
+	ssd->node = nvmev_cpu_to_node(cpu_nr_dispatcher);
+
 	/* initialize conv_ftl internal layout architecture */
-	ssd->ch = kmalloc(sizeof(struct ssd_channel) * spp->nchs, GFP_KERNEL); // 40 * 8 = 320
+	ssd->ch = kmalloc_node(sizeof(struct ssd_channel) * spp->nchs, GFP_KERNEL,
+			       ssd->node); // 40 * 8 = 320
 	for (i = 0; i < spp->nchs; i++) {
-		ssd_init_ch(&(ssd->ch[i]), spp);
+		ssd_init_ch(&(ssd->ch[i]), spp, ssd->node);
 	}
 
 	/* Set CPU number to use same cpuclock as io.c */
 	ssd->cpu_nr_dispatcher = cpu_nr_dispatcher;
 
-	ssd->pcie = kmalloc(sizeof(struct ssd_pcie), GFP_KERNEL);
-	ssd_init_pcie(ssd->pcie, spp);
+	ssd->pcie = kmalloc_node(sizeof(struct ssd_pcie), GFP_KERNEL, ssd->node);
+	ssd_init_pcie(ssd->pcie, spp, ssd->node);
 
-	ssd->write_buffer = kmalloc(sizeof(struct buffer), GFP_KERNEL);
+	ssd->write_buffer = kmalloc_node(sizeof(struct buffer), GFP_KERNEL, ssd->node);
 	buffer_init(ssd->write_buffer, spp->write_buffer_size);
 
 	return;
@@ -371,9 +376,6 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 	struct ssd_channel *ch;
 	struct ppa *ppa = ncmd->ppa;
 	uint32_t cell;
-	NVMEV_DEBUG(
-		"SSD: %p, Enter stime: %lld, ch %d lun %d blk %d page %d command %d ppa 0x%llx\n",
-		ssd, ncmd->stime, ppa->g.ch, ppa->g.lun, ppa->g.blk, ppa->g.pg, c, ppa->ppa);
 
 	if (ppa->ppa == UNMAPPED_PPA) {
 		NVMEV_ERROR("Error ppa 0x%llx\n", ppa->ppa);
@@ -450,6 +452,9 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 		return 0;
 	}
 
+	trace_nvmev_nand(c, ppa->g.ch, ppa->g.lun, ppa->g.pl, ppa->g.blk, ppa->g.pg, cmd_stime,
+			 completed_time);
+
 	return completed_time;
 }
 
@@ -216,6 +216,7 @@ struct ssd {
 	struct ssd_pcie *pcie;
 	struct buffer *write_buffer;
 	unsigned int cpu_nr_dispatcher;
+	int node; /* of the dispatcher, where the FTL runs */
 };
 
 static inline struct ssd_channel *get_ch(struct ssd *ssd, struct ppa *ppa)
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "nvmev.h"
+#include "thin.h"
+
+/* An entry holds either the index of its page in the pool or the byte filling it */
+#define THIN_ENTRY_POOL (1U << 31)
+#define THIN_ENTRY_FILL(byte) ((u32)(u8)(byte))
+#define THIN_ENTRY_BYTE(entry) ((u8)(entry))
+#define THIN_ENTRY_INDEX(entry) ((entry) & ~THIN_ENTRY_POOL)
+
+int thin_init(struct nvmev_thin *thin, u64 size, void *pool, size_t pool_size)
+{
+	u64 nr_pool_pages = min_t(u64, pool_size >> PAGE_SHIFT, THIN_ENTRY_POOL - 1);
+	unsigned int i;
+
+	thin->nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	thin->table = vzalloc(array_size(thin->nr_pages, sizeof(*thin->table)));
+	thin->free = vmalloc(array_size(nr_pool_pages, sizeof(*thin->free)));
+	if (!thin->table || !thin->free) {
+		vfree(thin->table);
+		vfree(thin->free);
+		thin->table = thin->free = NULL;
+		return -ENOMEM;
+	}
+
+	thin->pool = pool;
+	thin->nr_pool_pages = nr_pool_pages;
+
+	/* Hand out the pages from the start of the pool */
+	for (i = 0; i < nr_pool_pages; i++)
+		thin->free[i] = nr_pool_pages - 1 - i;
+	thin->nr_free = nr_pool_pages;
+	spin_lock_init(&thin->free_lock);
+
+	for (i = 0; i < NR_THIN_LOCKS; i++)
+		spin_lock_init(&thin->locks[i]);
+
+	return 0;
+}
+
+void thin_final(struct nvmev_thin *thin)
+{
+	vfree(thin->table);
+	vfree(thin->free);
+	thin->table = thin->free = NULL;
+}
+
+static bool __thin_alloc_page(struct nvmev_thin *thin, u32 *index)
+{
+	bool found = false;
+
+	spin_lock(&thin->free_lock);
+	if (thin->nr_free) {
+		*index = thin->free[--thin->nr_free];
+		found = true;
+	}
+	spin_unlock(&thin->free_lock);
+
+	return found;
+}
+
+static void __thin_free_page(struct nvmev_thin *thin, u32 index)
+{
+	spin_lock(&thin->free_lock);
+	thin->free[thin->nr_free++] = index;
+	spin_unlock(&thin->free_lock);
+}
+
+static inline void *__pool_page(struct nvmev_thin *thin, u32 entry)
+{
+	return thin->pool + ((size_t)THIN_ENTRY_INDEX(entry) << PAGE_SHIFT);
+}
+
+/*
+ * Write @len bytes from @buf at @offset of the namespace, not crossing a page.
+ * A page filled with a single byte as a whole gives its page in the pool
+ * back, if any. Returns an NVMe status code.
+ */
+unsigned int thin_write(struct nvmev_thin *thin, u64 offset, const void *buf, size_t len)
+{
+	u64 page = offset >> PAGE_SHIFT;
+	size_t offs = offset & ~PAGE_MASK;
+	spinlock_t *lock = &thin->locks[page % NR_THIN_LOCKS];
+	u8 byte = *(const u8 *)buf;
+	unsigned int status = NVME_SC_SUCCESS;
+	u32 entry, index;
+
+	if (page >= thin->nr_pages)
+		return NVME_SC_LBA_RANGE;
+
+	if (len == PAGE_SIZE && !memchr_inv(buf, byte, PAGE_SIZE)) {
+		spin_lock(lock);
+		entry = thin->table[page];
+		WRITE_ONCE(thin->table[page], THIN_ENTRY_FILL(byte));
+		spin_unlock(lock);
+
+		if (entry & THIN_ENTRY_POOL)
+			__thin_free_page(thin, THIN_ENTRY_INDEX(entry));
+		return NVME_SC_SUCCESS;
+	}
+
+	spin_lock(lock);
+
+	entry = thin->table[page];
+	if (entry & THIN_ENTRY_POOL) {
+		memcpy(__pool_page(thin, entry) + offs, buf, len);
+		goto out;
+	}
+
+	if (!__thin_alloc_page(thin, &index)) {
+		status = NVME_SC_CAP_EXCEEDED;
+		goto out;
+	}
+
+	/* The rest of the page keeps the byte it has been filled with */
+	if (len != PAGE_SIZE)
+		memset(__pool_page(thin, index | THIN_ENTRY_POOL), THIN_ENTRY_BYTE(entry),
+		       PAGE_SIZE);
+	memcpy(__pool_page(thin, index | THIN_ENTRY_POOL) + offs, buf, len);
+
+	WRITE_ONCE(thin->table[page], index | THIN_ENTRY_POOL);
+out:
+	spin_unlock(lock);
+	return status;
+}
+
+/*
+ * Discard the whole pages in [@offset, @offset + @len) of the namespace, so
+ * that they read as zeros, and give their pages in the pool back.
+ */
+void thin_discard(struct nvmev_thin *thin, u64 offset, u64 len)
+{
+	u64 page = DIV_ROUND_UP(offset, PAGE_SIZE);
+	u64 end = min((offset + len) >> PAGE_SHIFT, thin->nr_pages);
+
+	for (; page < end; page++) {
+		spinlock_t *lock = &thin->locks[page % NR_THIN_LOCKS];
+		u32 entry;
+
+		spin_lock(lock);
+		entry = thin->table[page];
+		WRITE_ONCE(thin->table[page], THIN_ENTRY_FILL(0));
+		spin_unlock(lock);
+
+		if (entry & THIN_ENTRY_POOL)
+			__thin_free_page(thin, THIN_ENTRY_INDEX(entry));
+	}
+}
+
+/*
+ * Read @len bytes at @offset of the namespace into @buf, not crossing a page.
+ * Pages kept in the table only are not touched. A page in the pool is read
+ * under its lock, so that it is not given back and reused meanwhile. Returns
+ * an NVMe status code.
+ */
+unsigned int thin_read(struct nvmev_thin *thin, u64 offset, void *buf, size_t len)
+{
+	u64 page = offset >> PAGE_SHIFT;
+	spinlock_t *lock = &thin->locks[page % NR_THIN_LOCKS];
+	u32 entry;
+
+	if (page >= thin->nr_pages)
+		return NVME_SC_LBA_RANGE;
+
+	entry = READ_ONCE(thin->table[page]);
+	if (!(entry & THIN_ENTRY_POOL)) {
+		memset(buf, THIN_ENTRY_BYTE(entry), len);
+		return NVME_SC_SUCCESS;
+	}
+
+	spin_lock(lock);
+	entry = thin->table[page];
+	if (entry & THIN_ENTRY_POOL)
+		memcpy(buf, __pool_page(thin, entry) + (offset & ~PAGE_MASK), len);
+	else
+		memset(buf, THIN_ENTRY_BYTE(entry), len);
+	spin_unlock(lock);
+
+	return NVME_SC_SUCCESS;
+}
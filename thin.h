@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef _NVMEVIRT_THIN_H
+#define _NVMEVIRT_THIN_H
+
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#define NR_THIN_LOCKS 256
+
+/*
+ * Thin-provisioned storage of a namespace. Each page of the namespace is
+ * either filled with a single byte, which is kept in the table only, or
+ * backed by a page of the pool carved out of the reserved memory. Pages read
+ * as zeros until written, and take a page of the pool on the first write
+ * that does not fill them with a single byte.
+ */
+struct nvmev_thin {
+	u32 *table; /* per page of the namespace */
+	u64 nr_pages;
+
+	void *pool;
+	u32 nr_pool_pages;
+	u32 *free; /* stack of the free pages of the pool */
+	u32 nr_free;
+	spinlock_t free_lock;
+
+	/* Serialize the writes to a page, hashed by the page */
+	spinlock_t locks[NR_THIN_LOCKS];
+};
+
+int thin_init(struct nvmev_thin *thin, u64 size, void *pool, size_t pool_size);
+void thin_final(struct nvmev_thin *thin);
+unsigned int thin_write(struct nvmev_thin *thin, u64 offset, const void *buf, size_t len);
+unsigned int thin_read(struct nvmev_thin *thin, u64 offset, void *buf, size_t len);
+void thin_discard(struct nvmev_thin *thin, u64 offset, u64 len);
+
+#endif /* _NVMEVIRT_THIN_H */
@@ -0,0 +1,333 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <linux/random.h>
+#include <linux/sched/clock.h>
+#include <linux/vmalloc.h>
+
+#include "nvmev.h"
+#include "timing_wheel.h"
+
+#define __tw_work(tw, entry) nvmev_get_work((tw)->works, (entry))
+
+static inline unsigned int __level_shift(int level)
+{
+	return level ? TW_L0_BITS + (level - 1) * TW_LN_BITS : 0;
+}
+
+static inline struct nvmev_tw_slot *__get_slot(struct nvmev_timing_wheel *tw, int level,
+					       unsigned long long tick)
+{
+	if (level == 0)
+		return &tw->slots[tick & (TW_L0_SLOTS - 1)];
+
+	return &tw->slots[TW_L0_SLOTS + (level - 1) * TW_LN_SLOTS +
+			  ((tick >> __level_shift(level)) & (TW_LN_SLOTS - 1))];
+}
+
+static void __add_to_slot(struct nvmev_timing_wheel *tw, struct nvmev_tw_slot *slot,
+			  unsigned int entry)
+{
+	__tw_work(tw, entry)->next = -1;
+	if (slot->head == -1)
+		slot->head = entry;
+	else
+		__tw_work(tw, slot->tail)->next = entry;
+	slot->tail = entry;
+	slot->nr++;
+}
+
+static void __insert(struct nvmev_timing_wheel *tw, unsigned int entry)
+{
+	unsigned long long tick = __tw_work(tw, entry)->nsecs_target >> TW_TICK_SHIFT;
+	unsigned long long delta;
+	int level;
+
+	/* Already due; expire at the current tick */
+	if (tick < tw->curr_tick)
+		tick = tw->curr_tick;
+	delta = tick - tw->curr_tick;
+
+	for (level = 0; level < TW_NR_LEVELS - 1; level++) {
+		if (delta < (1ULL << __level_shift(level + 1)))
+			break;
+	}
+	/* Beyond the span of the wheel; park in the farthest slot */
+	if (delta >= (1ULL << __level_shift(TW_NR_LEVELS)))
+		tick = tw->curr_tick + (1ULL << __level_shift(TW_NR_LEVELS)) - 1;
+
+	__add_to_slot(tw, __get_slot(tw, level, tick), entry);
+	tw->nr_in_level[level]++;
+	tw->nr_entries++;
+}
+
+/*
+ * Called when @curr_tick wraps level 0; move the entries of the upper level
+ * slots that have come into range down to the lower levels.
+ */
+static void __cascade(struct nvmev_timing_wheel *tw)
+{
+	int level;
+
+	for (level = 1; level < TW_NR_LEVELS; level++) {
+		struct nvmev_tw_slot *slot = __get_slot(tw, level, tw->curr_tick);
+		unsigned int curr = slot->head;
+
+		tw->nr_in_level[level] -= slot->nr;
+		tw->nr_entries -= slot->nr;
+		slot->head = slot->tail = -1;
+		slot->nr = 0;
+
+		while (curr != -1) {
+			unsigned int next = __tw_work(tw, curr)->next;
+
+			__insert(tw, curr);
+			curr = next;
+		}
+
+		if ((tw->curr_tick >> __level_shift(level)) & (TW_LN_SLOTS - 1))
+			break;
+	}
+}
+
+static void __splice_slot(struct nvmev_timing_wheel *tw, struct nvmev_tw_slot *expired,
+			  struct nvmev_tw_slot *slot)
+{
+	if (slot->nr == 0)
+		return;
+
+	if (expired->head == -1)
+		expired->head = slot->head;
+	else
+		__tw_work(tw, expired->tail)->next = slot->head;
+	expired->tail = slot->tail;
+	expired->nr += slot->nr;
+
+	tw->nr_in_level[0] -= slot->nr;
+	tw->nr_entries -= slot->nr;
+	slot->head = slot->tail = -1;
+	slot->nr = 0;
+}
+
+void timing_wheel_init(struct nvmev_timing_wheel *tw, struct nvmev_io_work **works)
+{
+	int i;
+
+	tw->works = works;
+	tw->curr_tick = 0;
+	tw->nr_entries = 0;
+	memset(tw->nr_in_level, 0, sizeof(tw->nr_in_level));
+
+	for (i = 0; i < TW_NR_SLOTS; i++) {
+		tw->slots[i].head = tw->slots[i].tail = -1;
+		tw->slots[i].nr = 0;
+	}
+}
+
+/*
+ * Insert @entry to expire at its nsecs_target. The wheel is not advanced
+ * here; @nsecs_now is only used to catch up with the clock when the wheel
+ * is empty.
+ */
+void timing_wheel_insert(struct nvmev_timing_wheel *tw, unsigned int entry,
+			 unsigned long long nsecs_now)
+{
+	if (tw->nr_entries == 0)
+		tw->curr_tick = max(tw->curr_tick, nsecs_now >> TW_TICK_SHIFT);
+
+	__insert(tw, entry);
+}
+
+/*
+ * Advance the wheel to @nsecs_now and detach the entries whose target time
+ * has passed. Returns the first entry of the expired ones chained through
+ * their @next, or -1 if none.
+ */
+unsigned int timing_wheel_expire(struct nvmev_timing_wheel *tw, unsigned long long nsecs_now)
+{
+	unsigned long long now_tick = nsecs_now >> TW_TICK_SHIFT;
+	struct nvmev_tw_slot expired = { .head = -1, .tail = -1, .nr = 0 };
+	struct nvmev_tw_slot *slot;
+	unsigned int prev, curr;
+
+	if (tw->nr_entries == 0) {
+		tw->curr_tick = max(tw->curr_tick, now_tick);
+		return -1;
+	}
+
+	while (tw->curr_tick < now_tick) {
+		if (tw->nr_in_level[0] == 0) {
+			/* Nothing at level 0; jump to the next cascade at once */
+			unsigned long long next = round_up(tw->curr_tick + 1, TW_L0_SLOTS);
+
+			if (next > now_tick) {
+				tw->curr_tick = now_tick;
+				break;
+			}
+			tw->curr_tick = next;
+		} else {
+			__splice_slot(tw, &expired, __get_slot(tw, 0, tw->curr_tick));
+			tw->curr_tick++;
+		}
+
+		if (!(tw->curr_tick & (TW_L0_SLOTS - 1)))
+			__cascade(tw);
+	}
+
+	/* The current tick is partially passed; pick the entries already due */
+	slot = __get_slot(tw, 0, tw->curr_tick);
+	prev = -1;
+	curr = slot->head;
+	while (curr != -1) {
+		unsigned int next = __tw_work(tw, curr)->next;
+
+		if (__tw_work(tw, curr)->nsecs_target <= nsecs_now) {
+			if (prev == -1)
+				slot->head = next;
+			else
+				__tw_work(tw, prev)->next = next;
+			if (slot->tail == curr)
+				slot->tail = prev;
+			slot->nr--;
+			tw->nr_in_level[0]--;
+			tw->nr_entries--;
+
+			__add_to_slot(tw, &expired, curr);
+		} else {
+			prev = curr;
+		}
+		curr = next;
+	}
+
+	return expired.head;
+}
+
+/*
+ * Earliest target time in the wheel, or ULLONG_MAX if empty. The result is
+ * exact for requests at level 0 and a lower bound (i.e., the start of the
+ * slot) for requests at the upper levels. Both are looked at, since a request
+ * inserted to an upper level long ago may be due before those at level 0.
+ */
+unsigned long long timing_wheel_next_expiry(struct nvmev_timing_wheel *tw)
+{
+	unsigned long long nsecs_next = ULLONG_MAX;
+	int level, i;
+
+	if (tw->nr_entries == 0)
+		return ULLONG_MAX;
+
+	if (tw->nr_in_level[0]) {
+		for (i = 0; i < TW_L0_SLOTS; i++) {
+			struct nvmev_tw_slot *slot = __get_slot(tw, 0, tw->curr_tick + i);
+			unsigned int curr;
+
+			if (slot->nr == 0)
+				continue;
+
+			for (curr = slot->head; curr != -1; curr = __tw_work(tw, curr)->next)
+				nsecs_next = min(nsecs_next, __tw_work(tw, curr)->nsecs_target);
+			break;
+		}
+	}
+
+	for (level = 1; level < TW_NR_LEVELS; level++) {
+		unsigned long long base = tw->curr_tick >> __level_shift(level);
+
+		if (tw->nr_in_level[level] == 0)
+			continue;
+
+		/* The current slot has been cascaded; it can only hold a turn ahead */
+		for (i = 1; i <= TW_LN_SLOTS; i++) {
+			unsigned long long tick = (base + i) << __level_shift(level);
+
+			if (__get_slot(tw, level, tick)->nr) {
+				nsecs_next = min(nsecs_next, tick << TW_TICK_SHIFT);
+				break;
+			}
+		}
+	}
+
+	return nsecs_next;
+}
+
+/*
+ * Microbenchmark for the wheel, triggered by writing "tw_bench [qd]" to
+ * /proc/nvmev/debug. @qd requests are kept in the wheel while the clock
+ * advances by 1 us per step, and each expired request is inserted back
+ * with a new latency.
+ */
+#define TW_BENCH_NR_INSERTS (1 << 20)
+
+static unsigned long long __bench_latency(void)
+{
+	u32 rand = get_random_u32();
+
+	/* Mostly 10-100 us, with 1% of GC-like stalls up to 50 ms */
+	if (rand % 100 == 0)
+		return 1000000ULL + rand % 49000000;
+	return 10000 + rand % 90000;
+}
+
+void timing_wheel_bench(unsigned int qd)
+{
+	struct nvmev_timing_wheel *tw;
+	struct nvmev_io_work *works, **chunks;
+	unsigned int *batch;
+	unsigned long long now = 0, clock;
+	unsigned long long nsecs_insert = 0, nsecs_expire = 0;
+	unsigned long long nr_inserts = 0, nr_expires = 0;
+	unsigned int i;
+
+	tw = kzalloc(sizeof(*tw), GFP_KERNEL);
+	works = vzalloc(sizeof(*works) * round_up(qd, NR_WORKS_PER_CHUNK));
+	chunks = kvcalloc(DIV_ROUND_UP(qd, NR_WORKS_PER_CHUNK), sizeof(*chunks), GFP_KERNEL);
+	batch = vmalloc(sizeof(*batch) * qd);
+	if (!tw || !works || !chunks || !batch)
+		goto out;
+
+	/* Chunks laid out back to back; entries can be indexed directly */
+	for (i = 0; i < DIV_ROUND_UP(qd, NR_WORKS_PER_CHUNK); i++)
+		chunks[i] = works + i * NR_WORKS_PER_CHUNK;
+	timing_wheel_init(tw, chunks);
+
+	for (i = 0; i < qd; i++) {
+		works[i].nsecs_target = now + __bench_latency();
+		batch[i] = i;
+	}
+	clock = local_clock();
+	for (i = 0; i < qd; i++)
+		timing_wheel_insert(tw, batch[i], now);
+	nsecs_insert += local_clock() - clock;
+	nr_inserts += qd;
+
+	while (nr_inserts < TW_BENCH_NR_INSERTS) {
+		unsigned int curr, nr = 0;
+
+		now += 1000;
+
+		clock = local_clock();
+		curr = timing_wheel_expire(tw, now);
+		nsecs_expire += local_clock() - clock;
+		nr_expires++;
+
+		for (; curr != -1; curr = works[curr].next)
+			batch[nr++] = curr;
+		for (i = 0; i < nr; i++)
+			works[batch[i]].nsecs_target = now + __bench_latency();
+
+		clock = local_clock();
+		for (i = 0; i < nr; i++)
+			timing_wheel_insert(tw, batch[i], now);
+		nsecs_insert += local_clock() - clock;
+		nr_inserts += nr;
+
+		cond_resched();
+	}
+
+	NVMEV_INFO("timing wheel qd %u: %llu inserts, %llu ns/insert, %llu ns/expire call\n", qd,
+		   nr_inserts, nsecs_insert / nr_inserts, nsecs_expire / max(nr_expires, 1ULL));
+out:
+	vfree(batch);
+	kvfree(chunks);
+	vfree(works);
+	kfree(tw);
+}
@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef _NVMEVIRT_TIMING_WHEEL_H
+#define _NVMEVIRT_TIMING_WHEEL_H
+
+#include <linux/types.h>
+
+struct nvmev_io_work;
+
+/*
+ * Hierarchical timing wheel keeping the pending requests of an IO worker by
+ * their target time. Level 0 has 256 slots of one tick (1024 ns) each, and
+ * each of the upper levels has 64 slots covering a whole turn of the level
+ * below, so the wheel spans 2^26 ticks (~68 s) ahead. Farther requests are
+ * parked in the last slot and re-inserted when it is cascaded.
+ *
+ * Entries are chained through nvmev_io_work.next like the rest of the work
+ * queue, so insertion and expiry are O(1) without any allocation. Requests
+ * falling in the same tick expire in their insertion order.
+ */
+#define TW_TICK_SHIFT 10
+#define TW_L0_BITS 8
+#define TW_LN_BITS 6
+#define TW_NR_LEVELS 4
+
+#define TW_L0_SLOTS (1 << TW_L0_BITS)
+#define TW_LN_SLOTS (1 << TW_LN_BITS)
+#define TW_NR_SLOTS (TW_L0_SLOTS + (TW_NR_LEVELS - 1) * TW_LN_SLOTS)
+
+struct nvmev_tw_slot {
+	unsigned int head;
+	unsigned int tail;
+	unsigned int nr;
+};
+
+struct nvmev_timing_wheel {
+	struct nvmev_io_work **works; /* entries are indexes into these chunks */
+
+	unsigned long long curr_tick; /* ticks before this are all expired */
+	unsigned int nr_entries;
+	unsigned int nr_in_level[TW_NR_LEVELS];
+
+	struct nvmev_tw_slot slots[TW_NR_SLOTS];
+};
+
+void timing_wheel_init(struct nvmev_timing_wheel *tw, struct nvmev_io_work **works);
+void timing_wheel_insert(struct nvmev_timing_wheel *tw, unsigned int entry,
+			 unsigned long long nsecs_now);
+unsigned int timing_wheel_expire(struct nvmev_timing_wheel *tw, unsigned long long nsecs_now);
+unsigned long long timing_wheel_next_expiry(struct nvmev_timing_wheel *tw);
+void timing_wheel_bench(unsigned int qd);
+
+static inline bool timing_wheel_empty(struct nvmev_timing_wheel *tw)
+{
+	return tw->nr_entries == 0;
+}
+
+#endif
@@ -16,16 +16,21 @@ static void __init_descriptor(struct zns_ftl *zns_ftl)
 	uint32_t i = 0;
 	const uint32_t zrwa_buffer_size = zns_ftl->zp.zrwa_buffer_size;
 	const uint32_t zone_wb_size = zns_ftl->zp.zone_wb_size;
+	const int node = zns_ftl->ssd->node;
 
-	zns_ftl->zone_descs = kzalloc(sizeof(struct zone_descriptor) * nr_zones, GFP_KERNEL);
-	zns_ftl->report_buffer = kmalloc(
-		sizeof(struct zone_report) + sizeof(struct zone_descriptor) * nr_zones, GFP_KERNEL);
+	zns_ftl->zone_descs =
+		kzalloc_node(sizeof(struct zone_descriptor) * nr_zones, GFP_KERNEL, node);
+	zns_ftl->report_buffer = kmalloc_node(
+		sizeof(struct zone_report) + sizeof(struct zone_descriptor) * nr_zones, GFP_KERNEL,
+		node);
 
 	if (zrwa_buffer_size)
-		zns_ftl->zrwa_buffer = kmalloc(sizeof(struct buffer) * nr_zones, GFP_KERNEL);
+		zns_ftl->zrwa_buffer =
+			kmalloc_node(sizeof(struct buffer) * nr_zones, GFP_KERNEL, node);
 
 	if (zone_wb_size)
-		zns_ftl->zone_write_buffer = kmalloc(sizeof(struct buffer) * nr_zones, GFP_KERNEL);
+		zns_ftl->zone_write_buffer =
+			kmalloc_node(sizeof(struct buffer) * nr_zones, GFP_KERNEL, node);
 
 	zone_descs = zns_ftl->zone_descs;
 
@@ -130,13 +135,14 @@ void zns_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *m
 	struct znsparams zpp;
 
 	const uint32_t nr_parts = 1; /* Not support multi partitions for zns*/
+	const int node = nvmev_cpu_to_node(cpu_nr_dispatcher);
 	NVMEV_ASSERT(nr_parts == 1);
 
-	ssd = kmalloc(sizeof(struct ssd), GFP_KERNEL);
+	ssd = kmalloc_node(sizeof(struct ssd), GFP_KERNEL, node);
 	ssd_init_params(&spp, size, nr_parts);
 	ssd_init(ssd, &spp, cpu_nr_dispatcher);
 
-	zns_ftl = kmalloc(sizeof(struct zns_ftl) * nr_parts, GFP_KERNEL);
+	zns_ftl = kmalloc_node(sizeof(struct zns_ftl) * nr_parts, GFP_KERNEL, node);
 	zns_init_params(&zpp, &spp, size);
 	zns_init_ftl(zns_ftl, &zpp, ssd, mapped_addr);
 
@@ -220,3 +226,64 @@ bool zns_proc_nvme_io_cmd(struct nvmev_ns *ns, struct nvmev_request *req, struct
 
 	return true;
 }
+
+/*
+ * The zone descriptors and resources of the namespace, along with the ZRWA
+ * buffers in use. The zone write buffers are drained by the time of saving.
+ */
+void zns_save_namespace(struct nvmev_ns *ns, struct nvmev_ckpt *ckpt)
+{
+	struct zns_ftl *zns_ftl = (struct zns_ftl *)ns->ftls;
+	uint32_t nr_zones = zns_ftl->zp.nr_zones;
+	uint32_t i;
+
+	ckpt_write(ckpt, &nr_zones, sizeof(nr_zones));
+	ckpt_write(ckpt, zns_ftl->zone_descs, sizeof(struct zone_descriptor) * nr_zones);
+
+	for (i = 0; i < RES_TYPE_COUNT; i++)
+		ckpt_write(ckpt, &zns_ftl->res_infos[i].acquired_cnt,
+			   sizeof(zns_ftl->res_infos[i].acquired_cnt));
+
+	for (i = 0; zns_ftl->zp.zrwa_buffer_size && i < nr_zones; i++) {
+		uint64_t remaining = zns_ftl->zrwa_buffer[i].remaining;
+
+		ckpt_write(ckpt, &remaining, sizeof(remaining));
+	}
+}
+
+int zns_restore_namespace(struct nvmev_ns *ns, struct nvmev_ckpt *ckpt)
+{
+	struct zns_ftl *zns_ftl = (struct zns_ftl *)ns->ftls;
+	uint32_t nr_zones;
+	uint32_t i;
+
+	ckpt_read(ckpt, &nr_zones, sizeof(nr_zones));
+	if (ckpt->error)
+		return ckpt->error;
+
+	if (nr_zones != zns_ftl->zp.nr_zones) {
+		NVMEV_ERROR("Checkpoint has %u zones, not %u\n", nr_zones, zns_ftl->zp.nr_zones);
+		return -EINVAL;
+	}
+
+	ckpt_read(ckpt, zns_ftl->zone_descs, sizeof(struct zone_descriptor) * nr_zones);
+
+	for (i = 0; i < RES_TYPE_COUNT; i++) {
+		struct zone_resource_info *res = &zns_ftl->res_infos[i];
+
+		ckpt_read(ckpt, &res->acquired_cnt, sizeof(res->acquired_cnt));
+		if (!ckpt->error && res->acquired_cnt > res->total_cnt)
+			return -EINVAL;
+	}
+
+	for (i = 0; zns_ftl->zp.zrwa_buffer_size && i < nr_zones; i++) {
+		uint64_t remaining;
+
+		ckpt_read(ckpt, &remaining, sizeof(remaining));
+		if (!ckpt->error && remaining > zns_ftl->zrwa_buffer[i].size)
+			return -EINVAL;
+		zns_ftl->zrwa_buffer[i].remaining = remaining;
+	}
+
+	return ckpt->error;
+}
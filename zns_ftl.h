@@ -6,6 +6,7 @@
 #include <linux/types.h>
 #include "nvmev.h"
 #include "nvme_zns.h"
+#include "checkpoint.h"
 
 #define NVMEV_ZNS_DEBUG(string, args...) //printk(KERN_INFO "%s: " string, NVMEV_DRV_NAME, ##args)
 
@@ -136,6 +137,9 @@ void zns_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *m
 			uint32_t cpu_nr_dispatcher);
 void zns_remove_namespace(struct nvmev_ns *ns);
 
+void zns_save_namespace(struct nvmev_ns *ns, struct nvmev_ckpt *ckpt);
+int zns_restore_namespace(struct nvmev_ns *ns, struct nvmev_ckpt *ckpt);
+
 void zns_zmgmt_recv(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_result *ret);
 void zns_zmgmt_send(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_result *ret);
 bool zns_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_result *ret);
@@ -9,6 +9,7 @@
 #include "nvmev.h"
 #include "ssd.h"
 #include "zns_ftl.h"
+#include "sgl.h"
 
 static uint64_t __prp_transfer_data(uint64_t prp1, uint64_t prp2, void *buffer, uint64_t length,
 				    uint32_t io)
@@ -136,8 +137,12 @@ void zns_zmgmt_recv(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev
 	if (__check_zmgmt_rcv_option_supported(zns_ftl, cmd)) {
 		__fill_zone_report(zns_ftl, cmd, buffer);
 
-		__prp_transfer_data(prp1, prp2, buffer, length, 0);
-		status = NVME_SC_SUCCESS;
+		if (nvmev_cmd_uses_sgl(cmd)) {
+			status = sgl_transfer(nvmev_cmd_sgl(cmd), buffer, length, true, NULL);
+		} else {
+			__prp_transfer_data(prp1, prp2, buffer, length, 0);
+			status = NVME_SC_SUCCESS;
+		}
 	} else {
 		status = NVME_SC_INVALID_FIELD;
 	}
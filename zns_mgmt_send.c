@@ -114,7 +114,9 @@ static void __reset_zone(struct zns_ftl *zns_ftl, uint64_t zid)
 	NVMEV_ZNS_DEBUG("%s zid %llu start addres 0x%llx zone_size %x \n", __func__,
 			zid, (uint64_t)zone_start_addr, zone_size);
 
-	memset(zone_start_addr, 0, zone_size);
+	/* Timing-only and thin namespaces keep no data in the reserved memory */
+	if (zns_ftl->storage_base_addr)
+		memset(zone_start_addr, 0, zone_size);
 
 	zone_descs[zid].wp = zone_descs[zid].zslba;
 	zone_descs[zid].zrwav = 0;
@@ -257,6 +259,13 @@ static uint32_t __zmgmt_send(struct zns_ftl *zns_ftl, uint64_t slba, uint32_t ac
 	return status;
 }
 
+/* A reset zone reads as zeros; a thin namespace gives its pages back to the pool */
+static void __discard_zone(struct nvmev_ns *ns, struct zns_ftl *zns_ftl, uint64_t zid)
+{
+	if (ns->thin)
+		thin_discard(ns->thin, zid * zns_ftl->zp.zone_size, zns_ftl->zp.zone_size);
+}
+
 void zns_zmgmt_send(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_result *ret)
 {
 	struct zns_ftl *zns_ftl = (struct zns_ftl *)ns->ftls;
@@ -270,10 +279,17 @@ void zns_zmgmt_send(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev
 	uint64_t zid = lba_to_zone(zns_ftl, slba);
 
 	if (select_all) {
-		for (zid = 0; zid < zns_ftl->zp.nr_zones; zid++)
-			__zmgmt_send(zns_ftl, zone_to_slba(zns_ftl, zid), action, option);
+		for (zid = 0; zid < zns_ftl->zp.nr_zones; zid++) {
+			uint32_t zone_status =
+				__zmgmt_send(zns_ftl, zone_to_slba(zns_ftl, zid), action, option);
+
+			if (zone_status == NVME_SC_SUCCESS && action == ZSA_RESET_ZONE)
+				__discard_zone(ns, zns_ftl, zid);
+		}
 	} else {
 		status = __zmgmt_send(zns_ftl, slba, action, option);
+		if (status == NVME_SC_SUCCESS && action == ZSA_RESET_ZONE)
+			__discard_zone(ns, zns_ftl, zid);
 	}
 
 	NVMEV_ZNS_DEBUG("%s slba %llx zid %llu select_all %u action %u status %u option %u\n",
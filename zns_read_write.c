@@ -3,6 +3,7 @@
 #include "nvmev.h"
 #include "ssd.h"
 #include "zns_ftl.h"
+#include "nvmev_trace.h"
 
 static inline uint32_t __nr_lbas_from_rw_cmd(struct nvme_rw_command *cmd)
 {
@@ -94,8 +95,7 @@ static bool __zns_write(struct zns_ftl *zns_ftl, struct nvmev_request *req,
 	elpn = lba_to_lpn(zns_ftl, slba + nr_lba - 1);
 	zone_elpn = zone_to_elpn(zns_ftl, zid);
 
-	NVMEV_ZNS_DEBUG("%s slba 0x%llx nr_lba 0x%llx zone_id %d state %d\n", __func__, slba,
-			nr_lba, zid, state);
+	trace_nvmev_zone_write(zid, slba, nr_lba, state, zone_descs[zid].wp, 0);
 
 	if (zns_ftl->zp.zone_wb_size)
 		write_buffer = &(zns_ftl->zone_write_buffer[zid]);
@@ -255,11 +255,6 @@ static bool __zns_write_zrwa(struct zns_ftl *zns_ftl, struct nvmev_request *req,
 
 	uint64_t nr_lbas_flush = 0, lpn, remaining, pgs = 0, pg_off;
 
-	NVMEV_DEBUG(
-		"%s slba 0x%llx nr_lba 0x%llx zone_id %d state %d wp 0x%llx zrwa_impl_start 0x%llx zrwa_impl_end 0x%llx  buffer %lu\n",
-		__func__, slba, nr_lba, zid, state, prev_wp, zrwa_impl_start, zrwa_impl_end,
-		zns_ftl->zrwa_buffer[zid].remaining);
-
 	if ((LBA_TO_BYTE(nr_lba) % spp->write_unit_size) != 0) {
 		status = NVME_SC_ZNS_INVALID_WRITE;
 		goto out;
@@ -316,19 +311,13 @@ static bool __zns_write_zrwa(struct zns_ftl *zns_ftl, struct nvmev_request *req,
 	if (elba >= zrwa_impl_start) {
 		nr_lbas_flush = DIV_ROUND_UP((elba - zrwa_impl_start + 1), lbas_per_zrwafg) *
 				lbas_per_zrwafg;
-
-		NVMEV_DEBUG("%s implicitly flush zid %d wp before 0x%llx after 0x%llx buffer %lu",
-			    __func__, zid, prev_wp, zone_descs[zid].wp + nr_lbas_flush,
-			    zns_ftl->zrwa_buffer[zid].remaining);
 	} else if (elba == zone_to_elba(zns_ftl, zid)) {
 		// Workaround. move wp to end of the zone and make state full implicitly
 		nr_lbas_flush = elba - prev_wp + 1;
-
-		NVMEV_DEBUG("%s end of zone zid %d wp before 0x%llx after 0x%llx buffer %lu",
-			    __func__, zid, prev_wp, zone_descs[zid].wp + nr_lbas_flush,
-			    zns_ftl->zrwa_buffer[zid].remaining);
 	}
 
+	trace_nvmev_zone_write(zid, slba, nr_lba, state, prev_wp, nr_lbas_flush);
+
 	if (nr_lbas_flush > 0) {
 		if (!buffer_allocate(&zns_ftl->zrwa_buffer[zid], LBA_TO_BYTE(nr_lbas_flush)))
 			return false;
@@ -390,8 +379,6 @@ bool zns_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_resu
 	// get zone from start_lba
 	uint32_t zid = lpn_to_zone(zns_ftl, slpn);
 
-	NVMEV_DEBUG("%s slba 0x%llx zone_id %d \n", __func__, cmd->slba, zid);
-
 	if (zone_descs[zid].zrwav == 0)
 		return __zns_write(zns_ftl, req, ret);
 	else